@@ -31,8 +31,50 @@
 #define _MODBUSINO_RTU_MAX_ADU_LENGTH 256
 
 // Supported function codes
+#define _FC_READ_COILS                0x01
+#define _FC_READ_DISCRETE_INPUTS      0x02
 #define _FC_READ_HOLDING_REGISTERS    0x03
+#define _FC_READ_INPUT_REGISTERS      0x04
+#define _FC_WRITE_SINGLE_COIL         0x05
+#define _FC_WRITE_SINGLE_REGISTER     0x06
+#define _FC_DIAGNOSTICS               0x08
+#define _FC_GET_COMM_EVENT_COUNTER    0x0B
+#define _FC_WRITE_MULTIPLE_COILS      0x0F
 #define _FC_WRITE_MULTIPLE_REGISTERS  0x10
+#define _FC_READ_FILE_RECORD          0x14
+#define _FC_WRITE_FILE_RECORD         0x15
+#define _FC_MASK_WRITE_REGISTER       0x16
+#define _FC_WRITE_AND_READ_REGISTERS  0x17
+#define _FC_READ_FIFO_QUEUE           0x18
+#define _FC_ENCAPSULATED_INTERFACE    0x2B
+
+// Supported MODBUS encapsulated interface types
+#define _MEI_READ_DEVICE_ID           0x0E
+
+// Read device ID codes
+#define _DEVICE_ID_BASIC_STREAM       0x01
+#define _DEVICE_ID_REGULAR_STREAM     0x02
+#define _DEVICE_ID_EXTENDED_STREAM    0x03
+#define _DEVICE_ID_SPECIFIC_OBJECT    0x04
+
+#define _DEVICE_ID_INDIVIDUAL_ACCESS  0x80
+
+// Longest object value, alone in a response after the 7 bytes of its header
+// and the id and length of the object
+#define _DEVICE_ID_MAX_VALUE_LENGTH   (MODBUS_MAX_PDU_LENGTH - 9)
+
+// Segment accesses forbidding a request to read or write their registers
+#define _DENIED_READ                  MODBUS_ACCESS_WRITE_ONLY
+#define _DENIED_WRITE                 MODBUS_ACCESS_READ_ONLY
+
+// File record sub-requests
+#define _FILE_REFERENCE_TYPE          6
+#define _FILE_SUB_REQ_LENGTH          7
+#define _FILE_MAX_READ_RECORDS        ((MODBUS_MAX_PDU_LENGTH - 4) / 2)
+#define _FILE_MAX_WRITE_RECORDS       ((MODBUS_MAX_PDU_LENGTH - 9) / 2)
+
+// Registers converted at once while a read response is being sent
+#define _SEND_CHUNK_REGISTERS         16
 
 enum {
 	_STEP_FUNCTION = 0x01,
@@ -40,19 +82,154 @@ enum {
 	_STEP_DATA
 };
 
-SimpleModbusSlave::SimpleModbusSlave(uint8_t slave) {
-	if (slave >= 0 & slave <= 247) {
-		_slave = slave;
+// Supported diagnostics sub-functions
+#define _DIAG_RETURN_QUERY_DATA          0x00
+#define _DIAG_CLEAR_COUNTERS             0x0A
+#define _DIAG_BUS_MESSAGE_COUNT          0x0B
+#define _DIAG_BUS_COMM_ERROR_COUNT       0x0C
+#define _DIAG_SLAVE_EXCEPTION_COUNT      0x0D
+#define _DIAG_SLAVE_MESSAGE_COUNT        0x0E
+#define _DIAG_SLAVE_NO_RESPONSE_COUNT    0x0F
+#define _DIAG_BUS_CHAR_OVERRUN_COUNT     0x12
+
+// Direction of a frame on the bus: a request from the master (indication) or
+// the answer of the addressed slave (confirmation).
+enum {
+	_MSG_INDICATION,
+	_MSG_CONFIRMATION
+};
+
+#define _FRAME_RULE_EXCEPTION     modbus_frame_rule(1, 0)
+#define _FRAME_RULES_SIZE         0x2C
+
+// Request and response length rules of every public function code, so that
+// frames exchanged with other slaves can be skipped byte-exact.
+static constexpr uint8_t _frame_rules[_FRAME_RULES_SIZE][2] PROGMEM = {
+	/* 0x00 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x01 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(1, 1)},  // Read coils
+	/* 0x02 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(1, 1)},  // Read discrete inputs
+	/* 0x03 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(1, 1)},  // Read holding registers
+	/* 0x04 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(1, 1)},  // Read input registers
+	/* 0x05 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(4, 0)},  // Write single coil
+	/* 0x06 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(4, 0)},  // Write single register
+	/* 0x07 */ {modbus_frame_rule(0, 0),    modbus_frame_rule(1, 0)},  // Read exception status
+	/* 0x08 */ {modbus_frame_rule(4, 0),    modbus_frame_rule(4, 0)},  // Diagnostics
+	/* 0x09 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x0A */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x0B */ {modbus_frame_rule(0, 0),    modbus_frame_rule(4, 0)},  // Get comm event counter
+	/* 0x0C */ {modbus_frame_rule(0, 0),    modbus_frame_rule(1, 1)},  // Get comm event log
+	/* 0x0D */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x0E */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x0F */ {modbus_frame_rule(5, 5),    modbus_frame_rule(4, 0)},  // Write multiple coils
+	/* 0x10 */ {modbus_frame_rule(5, 5),    modbus_frame_rule(4, 0)},  // Write multiple registers
+	/* 0x11 */ {modbus_frame_rule(0, 0),    modbus_frame_rule(1, 1)},  // Report slave ID
+	/* 0x12 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x13 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x14 */ {modbus_frame_rule(1, 1),    modbus_frame_rule(1, 1)},  // Read file record
+	/* 0x15 */ {modbus_frame_rule(1, 1),    modbus_frame_rule(1, 1)},  // Write file record
+	/* 0x16 */ {modbus_frame_rule(6, 0),    modbus_frame_rule(6, 0)},  // Mask write register
+	/* 0x17 */ {modbus_frame_rule(9, 9),    modbus_frame_rule(1, 1)},  // Read/write multiple registers
+	/* 0x18 */ {modbus_frame_rule(2, 0),    modbus_frame_rule(2, 2)},  // Read FIFO queue
+	/* 0x19 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1A */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1B */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1C */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1D */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1E */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x1F */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x20 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x21 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x22 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x23 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x24 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x25 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x26 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x27 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x28 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x29 */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x2A */ {MODBUS_FRAME_RULE_UNKNOWN,  MODBUS_FRAME_RULE_UNKNOWN},
+	/* 0x2B */ {modbus_frame_rule(3, 0),    MODBUS_FRAME_RULE_UNKNOWN}, // Encapsulated interface (device identification)
+};
+
+static uint8_t get_frame_rule(uint8_t function, uint8_t msg_type) {
+	if (msg_type == _MSG_CONFIRMATION && (function & 0x80)) {
+		return _FRAME_RULE_EXCEPTION;
+	} else if (function < _FRAME_RULES_SIZE) {
+		return pgm_read_byte(&_frame_rules[function][msg_type]);
+	} else {
+		return MODBUS_FRAME_RULE_UNKNOWN;
+	}
+}
+
+// One nibble per slave address: 0 when the address is not served, otherwise
+// the index of its mapping plus one
+inline uint8_t SimpleModbusSlave::slave_index(uint8_t slave) {
+	return (_slaves[slave >> 1] >> ((slave & 1) << 2)) & 0x0F;
+}
+
+// One nibble per function code below 0x80: 0 when no user function is
+// registered, otherwise its index in _functions plus one
+inline uint8_t SimpleModbusSlave::function_index(uint8_t function) {
+	if (function & 0x80) return 0;
+	return (_functions_index[function >> 1] >> ((function & 1) << 2)) & 0x0F;
+}
+
+// The functions implemented by the library come first, user functions only
+// extend them
+uint8_t SimpleModbusSlave::frame_rule(uint8_t function, uint8_t msg_type) {
+	uint8_t rule = get_frame_rule(function, msg_type);
+	uint8_t index;
+
+	if (rule == MODBUS_FRAME_RULE_UNKNOWN && (index = function_index(function)) != 0) {
+		const modbus_function_t *f = &_functions[index - 1];
+		rule = pgm_read_byte(msg_type == _MSG_INDICATION ? &f->request_rule : &f->response_rule);
 	}
+	return rule;
+}
+
+SimpleModbusSlave::SimpleModbusSlave(uint8_t slave, HardwareSerial &serial) {
+	memset(_slaves, 0, sizeof(_slaves));
+	_nb_slaves = 0;
+	memset(&_mapping, 0, sizeof(_mapping));
+	addSlave(slave, &_mapping);
+
+	_serial = &serial;
+	_confirmation_slave = MODBUS_BROADCAST_ADDRESS;
+	_confirmation_function = 0;
+	_confirmation_time = 0;
+
+	memset(&_counters, 0, sizeof(_counters));
+
+	_device_id = NULL;
+	_nb_device_id = 0;
+
+	_functions = NULL;
+	memset(_functions_index, 0, sizeof(_functions_index));
 }
 
 void SimpleModbusSlave::setup(long baud, int RS485DE_Pin) {
-	Serial2.begin(baud);
+	_serial->begin(baud);
 	_pin_DE = RS485DE_Pin;
 }
 
+bool SimpleModbusSlave::addSlave(uint8_t slave, modbus_mapping_t *mapping) {
+	uint8_t index;
+
+	if (slave == MODBUS_BROADCAST_ADDRESS || slave > MODBUS_MAX_SLAVE_ADDRESS) return false;
+
+	index = slave_index(slave);
+	if (index == 0) {
+		if (_nb_slaves == MODBUS_MAX_SLAVES) return false;
+		index = ++_nb_slaves;
+		_slaves[slave >> 1] |= index << ((slave & 1) << 2);
+	}
+
+	_mappings[index - 1] = mapping;
+	return true;
+}
+
 // Check CRC of msg
-static int check_integrity(uint8_t *msg, uint8_t msg_length) {
+static int check_integrity(uint8_t *msg, uint16_t msg_length) {
 	if ((msg_length >= 2) && crc16(msg, msg_length) == 0) {
 		return msg_length;
 	} else {
@@ -66,14 +243,52 @@ static int build_response_basis(uint8_t slave, uint8_t function, uint8_t* rsp) {
 	return _MODBUS_RTU_PRESET_RSP_LENGTH;
 }
 
-static void send_msg(uint8_t *msg, uint8_t msg_length) {
-	add_crc16(msg, msg_length);
+// Responses are streamed: every byte goes to the UART as soon as it is
+// produced and the CRC is updated on the fly, then appended last.
+void SimpleModbusSlave::send_begin(void) {
+	_send_crc = CRC16_INITIAL_VALUE;
+	digitalWrite(_pin_DE, 1);
+}
+
+inline void SimpleModbusSlave::send_byte(uint8_t c) {
+	_send_crc = crc16_update(_send_crc, c);
+	_serial->write(c);
+}
+
+void SimpleModbusSlave::send_bytes(const uint8_t *data, uint8_t length) {
+	while (length--) {
+		send_byte(*(data++));
+	}
+}
+
+void SimpleModbusSlave::send_end(void) {
+	_serial->write(_send_crc & 0xFF);
+	_serial->write(_send_crc >> 8);
+
+	// Wait for the end of the transmission before releasing the line
+	_serial->flush();
+	digitalWrite(_pin_DE, 0);
+}
+
+void SimpleModbusSlave::send_msg(uint8_t *msg, uint8_t msg_length) {
+	// Only the exceptions actually sent count, not those of broadcasts
+	if (msg[_MODBUS_RTU_FUNCTION] & 0x80) _counters.exceptions++;
+
+	send_begin();
+	send_bytes(msg, msg_length);
+	send_end();
+}
+
+// Sends back a request, CRC included, as the response of a function whose
+// response is an echo
+void SimpleModbusSlave::send_echo(uint8_t *req, uint16_t req_length) {
 	digitalWrite(_pin_DE, 1);
-	Serial2.write(msg, msg_length + 2);
+	_serial->write(req, req_length + _MODBUS_RTU_CHECKSUM_LENGTH);
+	_serial->flush();
 	digitalWrite(_pin_DE, 0);
 }
 
-static uint8_t response_exception(uint8_t slave, uint8_t function, uint8_t exception_code, uint8_t *rsp) {
+uint8_t SimpleModbusSlave::response_exception(uint8_t slave, uint8_t function, uint8_t exception_code, uint8_t *rsp) {
 	uint8_t rsp_length = build_response_basis(slave, function + 0x80, rsp);
 
 	// Positive exception code
@@ -82,23 +297,27 @@ static uint8_t response_exception(uint8_t slave, uint8_t function, uint8_t excep
 	return rsp_length;
 }
 
-static void flush(void) {
+void SimpleModbusSlave::flush(void) {
 	uint8_t i = 0;
 
 	// Wait a moment to receive the remaining garbage but avoid getting stuck
 	// because the line is saturated
-	while (Serial2.available() && i++ < 10) {
-		Serial2.flush();
+	while (_serial->available() && i++ < 10) {
+		while (_serial->available()) _serial->read();
 		delay(3);
 	}
 }
 
-static int receive(uint8_t *req, uint8_t _slave) {
+int SimpleModbusSlave::receive(uint8_t *req) {
 	uint8_t i;
-	uint8_t length_to_read;
-	uint8_t req_index;
+	uint16_t length_to_read;
+	uint16_t req_index;
 	uint8_t step;
-	uint8_t function;
+	uint8_t slave = 0;
+	uint8_t function = 0;
+	uint8_t msg_type = _MSG_INDICATION;
+	uint8_t rule = 0;
+	int rc;
 
 	// We need to analyse the message step by step.  At the first step, we want
 	// to reach the function code because all packets contain this
@@ -112,15 +331,15 @@ static int receive(uint8_t *req, uint8_t _slave) {
 		// The timeout is defined to ~10 ms between each bytes.  Precision is
 		// not that important so I rather to avoid millis() to apply the KISS
 		// principle (millis overflows after 50 days, etc) */
-		if (!Serial2.available()) {
+		if (!_serial->available()) {
 			i = 0;
-			while (!Serial2.available()) {
+			while (!_serial->available()) {
 				if (++i == 10) return -1 - MODBUS_INFORMATIVE_RX_TIMEOUT; // Too late, bye
 				delay(1);
 			}
 		}
 
-		req[req_index] = Serial2.read();
+		req[req_index] = _serial->read();
 
 		// Moves the pointer to receive other data 
 		req_index++;
@@ -129,49 +348,66 @@ static int receive(uint8_t *req, uint8_t _slave) {
 		length_to_read--;
 
 		if (length_to_read == 0) {
-
-			if (req[_MODBUS_RTU_SLAVE] != _slave && req[_MODBUS_RTU_SLAVE != MODBUS_BROADCAST_ADDRESS]) {
-				flush();
-				return -1 - MODBUS_INFORMATIVE_NOT_FOR_US;
-			}
-
 			switch (step) {
 			case _STEP_FUNCTION:
-				// Function code position
+				slave    = req[_MODBUS_RTU_SLAVE];
 				function = req[_MODBUS_RTU_FUNCTION];
-				if (function == _FC_READ_HOLDING_REGISTERS) {
-					length_to_read = 4;
-				} else if (function == _FC_WRITE_MULTIPLE_REGISTERS) {
-					length_to_read = 5;
-				} else {
+				_counters.bus_messages++;
+
+				// The answer of the slave addressed by the previous request
+				// has the same slave and function (or exception) codes. After
+				// a silence, the slave is offline and this is a new request,
+				// a retry of the master for instance.
+				msg_type = _MSG_INDICATION;
+				if (_confirmation_slave != MODBUS_BROADCAST_ADDRESS &&
+				    millis() - _confirmation_time <= MODBUS_CONFIRMATION_TIMEOUT &&
+				    slave == _confirmation_slave && (function & 0x7F) == _confirmation_function) {
+					msg_type = _MSG_CONFIRMATION;
+				}
+				_confirmation_slave = MODBUS_BROADCAST_ADDRESS;
+
+				rule = frame_rule(function, msg_type);
+				if (rule == MODBUS_FRAME_RULE_UNKNOWN) {
 					// Wait a moment to receive the remaining garbage
 					flush();
-					if (req[_MODBUS_RTU_SLAVE] == _slave || req[_MODBUS_RTU_SLAVE] == MODBUS_BROADCAST_ADDRESS) {
+					if (msg_type == _MSG_INDICATION && slave_index(slave)) {
 						// It's for me so send an exception (reuse req)
-						uint8_t rsp_length = response_exception(_slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, req);
+						_counters.slave_messages++;
+						uint8_t rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, req);
 						send_msg(req, rsp_length);
 						return - 1 - MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
 					}
 
 					return -1;
 				}
-			step = _STEP_META;
-			break;
+
+				if ((rule >> 4) == 0) {
+					// Fixed length frame, its end is already known
+					length_to_read = (rule & 0x0F) + _MODBUS_RTU_CHECKSUM_LENGTH;
+					step = _STEP_DATA;
+					break;
+				}
+
+				step = _STEP_META;
+				length_to_read = rule & 0x0F;
+				break;
 
 			case _STEP_META:
 				length_to_read = _MODBUS_RTU_CHECKSUM_LENGTH;
 
-				if (function == _FC_WRITE_MULTIPLE_REGISTERS) {
-					length_to_read += req[_MODBUS_RTU_FUNCTION + 5];
+				if (rule >> 4) {
+					length_to_read += req[_MODBUS_RTU_FUNCTION + (rule >> 4)];
 				}
 
 				if ((req_index + length_to_read) > _MODBUSINO_RTU_MAX_ADU_LENGTH) {
 					flush();
-					if (req[_MODBUS_RTU_SLAVE] == _slave || req[_MODBUS_RTU_SLAVE] == MODBUS_BROADCAST_ADDRESS) {
+					_counters.overruns++;
+					if (msg_type == _MSG_INDICATION && slave_index(slave)) {
 						// It's for me so send an exception (reuse req)
-						uint8_t rsp_length = response_exception(_slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, req);
+						_counters.slave_messages++;
+						uint8_t rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, req);
 						send_msg(req, rsp_length);
-						return - 1 - MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+						return - 1 - MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
 					}
 					return -1;
 				}
@@ -180,10 +416,414 @@ static int receive(uint8_t *req, uint8_t _slave) {
 		}
 	}
 
-	return check_integrity(req, req_index);
+	rc = check_integrity(req, req_index);
+	if (rc < 0) {
+		// The length prediction went wrong, rely on the silence between
+		// frames to find the next one
+		flush();
+		_counters.bus_errors++;
+		return rc;
+	}
+
+	if (msg_type == _MSG_CONFIRMATION || (slave != MODBUS_BROADCAST_ADDRESS && !slave_index(slave))) {
+		// The frame has been skipped exactly, so the next one is aligned.
+		// Unless broadcast, a request to another slave is followed by its
+		// answer.
+		if (msg_type == _MSG_INDICATION) {
+			_confirmation_slave    = slave;
+			_confirmation_function = function;
+			_confirmation_time     = millis();
+		}
+		return -1 - MODBUS_INFORMATIVE_NOT_FOR_US;
+	}
+
+	_counters.slave_messages++;
+	return rc;
+}
+
+// Registers address to address + nb - 1 a request may access, the table of
+// a mapping without segments being seen as a single segment stored in whole
+static const modbus_segment_t *find_registers(const modbus_mapping_t *mapping, uint16_t address, uint16_t nb,
+                                              uint8_t denied, modbus_segment_t *whole) {
+	if (mapping->segments != NULL) {
+		return modbus_find_segments(mapping->segments, mapping->nb_segments, address, nb, denied);
+	}
+
+	memset(whole, 0, sizeof(*whole));
+	whole->nb            = mapping->nb_registers;
+	whole->tab_registers = mapping->tab_registers;
+	whole->tab_dirty     = mapping->tab_dirty_registers;
+	return modbus_find_segments(whole, 1, address, nb, denied);
+}
+
+static const modbus_segment_t *find_input_registers(const modbus_mapping_t *mapping, uint16_t address, uint16_t nb,
+                                                    modbus_segment_t *whole) {
+	if (mapping->input_segments != NULL) {
+		return modbus_find_segments(mapping->input_segments, mapping->nb_input_segments, address, nb, _DENIED_READ);
+	}
+
+	memset(whole, 0, sizeof(*whole));
+	whole->nb            = mapping->nb_input_registers;
+	whole->tab_registers = mapping->tab_input_registers;
+	return modbus_find_segments(whole, 1, address, nb, _DENIED_READ);
+}
+
+// Registers of segment from address, at most nb
+static uint16_t segment_slice(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	uint32_t n = (uint32_t) segment->address + segment->nb - address;
+	return n < nb ? n : nb;
+}
+
+// Registers stored as they are sent, without conversion
+static inline bool segment_plain(const modbus_segment_t *segment) {
+	return segment->format == MODBUS_FORMAT_UINT16 && segment->order == MODBUS_ORDER_ABCD;
+}
+
+// Tells the application about the registers of segment a master has just
+// written
+static void segment_written(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	if (segment->tab_dirty) modbus_set_bits(segment->tab_dirty, address - segment->address, nb);
+	if (segment->on_write) segment->on_write(segment, address, nb);
+}
+
+// Tells the application about the registers of every segment a request is
+// about to read, before any of them is copied
+static void segment_reading(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	for (; nb; segment++) {
+		uint16_t n = segment_slice(segment, address, nb);
+
+		if (segment->on_read) segment->on_read(segment, address, n);
+		address += n;
+		nb -= n;
+	}
+}
+
+// Copies nb registers to dest in the wire order, the registers may span
+// adjacent segments. Returns the segment of the register following them.
+static const modbus_segment_t *read_registers(const modbus_segment_t *segment, uint16_t address, uint16_t nb,
+                                              uint8_t *dest) {
+	while (nb) {
+		uint16_t n = segment_slice(segment, address, nb);
+		uint16_t offset = address - segment->address;
+		uint16_t i;
+
+		if (segment->order == MODBUS_ORDER_WIRE) {
+			memcpy(dest, segment->tab_registers + offset, 2 * n);
+		} else if (segment_plain(segment)) {
+			modbus_registers_to_wire(segment->tab_registers + offset, n, dest);
+		} else {
+			// Typed values are converted to the wire order here only
+			for (i = 0; i < n; i++) {
+				uint16_t value = modbus_segment_get(segment, offset + i);
+				dest[2 * i]     = value >> 8;
+				dest[2 * i + 1] = value & 0xFF;
+			}
+		}
+		if ((uint32_t) offset + n == segment->nb) segment++;
+		address += n;
+		nb -= n;
+		dest += 2 * n;
+	}
+	return segment;
+}
+
+// Sends a read registers response, converting the registers a chunk at a
+// time between the bytes sent, so the first byte leaves at once
+void SimpleModbusSlave::send_registers(uint8_t slave, uint8_t function, const modbus_segment_t *segment, uint16_t address, uint16_t nb,
+                                       const ModbusSeqlock *lock) {
+	uint8_t data[2 * _SEND_CHUNK_REGISTERS];
+	uint16_t n;
+
+	segment_reading(segment, address, nb);
+	if (lock) {
+		send_locked_registers(slave, function, segment, address, nb, lock);
+		return;
+	}
+
+	send_begin();
+	send_byte(slave);
+	send_byte(function);
+	send_byte(nb << 1);
+	for (; nb; address += n, nb -= n) {
+		n = nb < _SEND_CHUNK_REGISTERS ? nb : _SEND_CHUNK_REGISTERS;
+		segment = read_registers(segment, address, n, data);
+		send_bytes(data, n << 1);
+	}
+	send_end();
+}
+
+// Under a lock, all the registers are copied, again until no write got in
+// the way, before the response is sent. Kept apart so that its buffer is
+// only on the stack when a lock is used.
+void __attribute__((noinline)) SimpleModbusSlave::send_locked_registers(uint8_t slave, uint8_t function,
+                                                                        const modbus_segment_t *segment, uint16_t address,
+                                                                        uint16_t nb, const ModbusSeqlock *lock) {
+	uint8_t data[2 * MODBUS_MAX_READ_REGISTERS];
+	uint32_t sequence;
+
+	do {
+		sequence = lock->readBegin();
+		read_registers(segment, address, nb, data);
+	} while (lock->readRetry(sequence));
+
+	send_begin();
+	send_byte(slave);
+	send_byte(function);
+	send_byte(nb << 1);
+	send_bytes(data, nb << 1);
+	send_end();
+}
+
+// Stores nb registers received big-endian in values, all of them under the
+// lock when there is one. The application is told once the lock is released.
+void SimpleModbusSlave::write_registers(modbus_mapping_t *mapping, const modbus_segment_t *segment, uint16_t address,
+                                        uint16_t nb, const uint8_t *values) {
+	ModbusSeqlock *lock = mapping->lock;
+	const modbus_segment_t *first = segment;
+	uint16_t first_address = address, first_nb = nb;
+
+	if (lock) lock->writeBegin();
+	for (; nb; segment++) {
+		uint16_t n = segment_slice(segment, address, nb);
+		uint16_t offset = address - segment->address;
+		uint16_t i;
+
+		if (segment->order == MODBUS_ORDER_WIRE) {
+			memcpy(segment->tab_registers + offset, values, 2 * n);
+		} else if (segment_plain(segment)) {
+			modbus_registers_from_wire(values, n, segment->tab_registers + offset);
+		} else {
+			for (i = 0; i < n; i++) {
+				modbus_segment_set(segment, offset + i, (values[2 * i] << 8) + values[2 * i + 1]);
+			}
+		}
+		address += n;
+		nb -= n;
+		values += 2 * n;
+	}
+	if (lock) lock->writeEnd();
+
+	for (segment = first, address = first_address, nb = first_nb; nb; segment++) {
+		uint16_t n = segment_slice(segment, address, nb);
+
+		segment_written(segment, address, n);
+		address += n;
+		nb -= n;
+	}
+	if (mapping->changes) mapping->changes->push(first_address, first_nb);
+}
+
+// Length of the value of an object, truncated so that it always fits in a
+// response on its own and the master never pages forever
+static uint8_t device_id_length(const char *value) {
+	size_t length = strlen_P(value);
+	return length < _DEVICE_ID_MAX_VALUE_LENGTH ? length : _DEVICE_ID_MAX_VALUE_LENGTH;
+}
+
+// Streams a read device identification response straight from flash.
+// Returns an exception code, 0 when the response has been sent.
+uint8_t SimpleModbusSlave::send_device_identification(uint8_t slave, uint8_t code, uint8_t object_id) {
+	uint8_t first = 0, last, i, nb = 0;
+	uint8_t conformity, more = 0, next = 0;
+	uint16_t length = 7;  // Function, MEI type, code, conformity, more follows, next id and number of objects
+	uint8_t last_id;
+
+	if (code < _DEVICE_ID_BASIC_STREAM || code > _DEVICE_ID_SPECIFIC_OBJECT) {
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	if (_nb_device_id == 0) return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+	// The conformity level is the highest category of objects available
+	last_id = pgm_read_byte(&_device_id[_nb_device_id - 1].id);
+	if (last_id >= 0x80) {
+		conformity = _DEVICE_ID_EXTENDED_STREAM;
+	} else if (last_id > MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION) {
+		conformity = _DEVICE_ID_REGULAR_STREAM;
+	} else {
+		conformity = _DEVICE_ID_BASIC_STREAM;
+	}
+
+	if (code == _DEVICE_ID_SPECIFIC_OBJECT) {
+		last_id = object_id;
+	} else if (code == _DEVICE_ID_BASIC_STREAM) {
+		last_id = MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION;
+	} else if (code == _DEVICE_ID_REGULAR_STREAM) {
+		last_id = 0x7F;
+	} else {
+		last_id = 0xFF;
+	}
+
+	// An unknown object, or one outside the category, restarts the stream at
+	// the beginning
+	while (first < _nb_device_id && pgm_read_byte(&_device_id[first].id) != object_id) first++;
+	if (first == _nb_device_id || object_id > last_id) {
+		if (code == _DEVICE_ID_SPECIFIC_OBJECT) return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		first = 0;
+	}
+
+	// Count the objects fitting in the response, the rest is left for the
+	// next request
+	for (i = first; i < _nb_device_id && pgm_read_byte(&_device_id[i].id) <= last_id; i++) {
+		uint16_t object_length = 2 + device_id_length((const char *) pgm_read_ptr(&_device_id[i].value));
+
+		if (length + object_length > MODBUS_MAX_PDU_LENGTH) {
+			more = 0xFF;
+			next = pgm_read_byte(&_device_id[i].id);
+			break;
+		}
+
+		length += object_length;
+		nb++;
+		if (code == _DEVICE_ID_SPECIFIC_OBJECT) break;
+	}
+	last = first + nb;
+
+	if (slave == MODBUS_BROADCAST_ADDRESS) return 0;
+
+	send_begin();
+	send_byte(slave);
+	send_byte(_FC_ENCAPSULATED_INTERFACE);
+	send_byte(_MEI_READ_DEVICE_ID);
+	send_byte(code);
+	send_byte(conformity | _DEVICE_ID_INDIVIDUAL_ACCESS);
+	send_byte(more);
+	send_byte(next);
+	send_byte(nb);
+	for (i = first; i < last; i++) {
+		const char *value = (const char *) pgm_read_ptr(&_device_id[i].value);
+		uint8_t value_length = device_id_length(value);
+
+		send_byte(pgm_read_byte(&_device_id[i].id));
+		send_byte(value_length);
+		while (value_length--) {
+			send_byte(pgm_read_byte(value++));
+		}
+	}
+	send_end();
+
+	return 0;
+}
+
+// Checks the reference type and the records of a sub-request, before any
+// arithmetic on its length. Returns an exception code, 0 when valid.
+static uint8_t check_file_sub_request(const uint8_t *sub_req, uint16_t max_nb) {
+	/* 0 = reference type, 1 and 2 = file, 3 and 4 = record, 5 and 6 = length */
+	uint16_t record = (sub_req[3] << 8) + sub_req[4];
+	uint16_t nb     = (sub_req[5] << 8) + sub_req[6];
+
+	if (nb == 0 || nb > max_nb) return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	if (sub_req[0] != _FILE_REFERENCE_TYPE || (uint32_t) record + nb > MODBUS_MAX_FILE_RECORDS) {
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+	}
+	return 0;
+}
+
+// Streams the records of every sub-request straight from the file store.
+// Returns an exception code, 0 when the response has been sent.
+uint8_t SimpleModbusSlave::reply_read_file_record(ModbusFileStore *files, uint8_t *req) {
+	uint8_t  slave      = req[_MODBUS_RTU_SLAVE];
+	uint8_t  byte_count = req[_MODBUS_RTU_FUNCTION + 1];
+	uint8_t  *sub_req;
+	uint16_t length = 2;  // Function and response data length
+	uint8_t  i, rc;
+
+	if (byte_count < _FILE_SUB_REQ_LENGTH || byte_count > 0xF5 || byte_count % _FILE_SUB_REQ_LENGTH) {
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	// Every sub-request is checked before anything is sent
+	for (i = 0; i < byte_count; i += _FILE_SUB_REQ_LENGTH) {
+		sub_req = req + _MODBUS_RTU_FUNCTION + 2 + i;
+		rc = check_file_sub_request(sub_req, _FILE_MAX_READ_RECORDS);
+		if (rc) return rc;
+
+		uint16_t nb = (sub_req[5] << 8) + sub_req[6];
+		if (files->read((sub_req[1] << 8) + sub_req[2], (sub_req[3] << 8) + sub_req[4], nb) == NULL) {
+			return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		}
+
+		length += 2 + (nb << 1);
+		if (length > MODBUS_MAX_PDU_LENGTH) return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	if (slave == MODBUS_BROADCAST_ADDRESS) return 0;
+
+	send_begin();
+	send_byte(slave);
+	send_byte(_FC_READ_FILE_RECORD);
+	send_byte(length - 2);
+	for (i = 0; i < byte_count; i += _FILE_SUB_REQ_LENGTH) {
+		sub_req = req + _MODBUS_RTU_FUNCTION + 2 + i;
+		uint16_t nb = (sub_req[5] << 8) + sub_req[6];
+
+		send_byte(1 + (nb << 1));
+		send_byte(_FILE_REFERENCE_TYPE);
+		send_bytes(files->read((sub_req[1] << 8) + sub_req[2], (sub_req[3] << 8) + sub_req[4], nb), nb << 1);
+	}
+	send_end();
+
+	return 0;
+}
+
+// Stores the records of every sub-request, the response is an echo of the
+// request. Either every sub-request is applied or none, the store accepting
+// all of them before the first write. Returns an exception code, 0 when the
+// response has been sent.
+uint8_t SimpleModbusSlave::reply_write_file_record(ModbusFileStore *files, uint8_t *req, uint16_t req_length) {
+	uint8_t  slave       = req[_MODBUS_RTU_SLAVE];
+	uint8_t  data_length = req[_MODBUS_RTU_FUNCTION + 1];
+	uint8_t  *sub_req;
+	uint16_t i;
+	uint8_t  rc;
+
+	if (data_length < _FILE_SUB_REQ_LENGTH + 2 || data_length > 0xFB) {
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	// The sub-requests must exactly fill the request
+	i = 0;
+	while (i < data_length) {
+		/* 7 = data */
+		sub_req = req + _MODBUS_RTU_FUNCTION + 2 + i;
+		if (i + _FILE_SUB_REQ_LENGTH > data_length) return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		rc = check_file_sub_request(sub_req, _FILE_MAX_WRITE_RECORDS);
+		if (rc) return rc;
+
+		// The records must be within the request as well
+		i += _FILE_SUB_REQ_LENGTH + (((sub_req[5] << 8) + sub_req[6]) << 1);
+		if (i > data_length) return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	i = 0;
+	while (i < data_length) {
+		sub_req = req + _MODBUS_RTU_FUNCTION + 2 + i;
+		uint16_t nb = (sub_req[5] << 8) + sub_req[6];
+
+		if (!files->writable((sub_req[1] << 8) + sub_req[2], (sub_req[3] << 8) + sub_req[4], nb)) {
+			return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		}
+		i += _FILE_SUB_REQ_LENGTH + (nb << 1);
+	}
+
+	i = 0;
+	while (i < data_length) {
+		sub_req = req + _MODBUS_RTU_FUNCTION + 2 + i;
+		uint16_t nb = (sub_req[5] << 8) + sub_req[6];
+
+		if (!files->write((sub_req[1] << 8) + sub_req[2], (sub_req[3] << 8) + sub_req[4], nb, sub_req + _FILE_SUB_REQ_LENGTH)) {
+			return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		}
+		i += _FILE_SUB_REQ_LENGTH + (nb << 1);
+	}
+
+	if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+	return 0;
 }
 
-static void reply(uint16_t *tab_reg, uint16_t nb_reg, uint8_t *req, uint8_t req_length, uint8_t _slave) {
+// Returns true when the request completed successfully, an event of the comm
+// event counter
+bool SimpleModbusSlave::reply(modbus_mapping_t *mapping, uint8_t *req, uint16_t req_length) {
 	uint8_t  slave    = req[_MODBUS_RTU_SLAVE];
 	uint8_t  function = req[_MODBUS_RTU_FUNCTION];
 	uint16_t address  = (req[_MODBUS_RTU_FUNCTION + 1] << 8) + req[_MODBUS_RTU_FUNCTION + 2];
@@ -191,48 +831,437 @@ static void reply(uint16_t *tab_reg, uint16_t nb_reg, uint8_t *req, uint8_t req_
 	uint8_t  rsp[_MODBUSINO_RTU_MAX_ADU_LENGTH];
 	uint8_t  rsp_length = 0;
 
-	if (slave != _slave && slave != MODBUS_BROADCAST_ADDRESS) return;
+	req_length -= _MODBUS_RTU_CHECKSUM_LENGTH;
 
-	if ((address + nb) > nb_reg) {
-		rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-	} else {
-		req_length -= _MODBUS_RTU_CHECKSUM_LENGTH;
+	switch (function) {
+	case _FC_READ_COILS:
+	case _FC_READ_DISCRETE_INPUTS: {
+		const uint8_t *tab_bits;
+		uint16_t nb_bits;
 
-		if (function == _FC_READ_HOLDING_REGISTERS) {
-			uint16_t i;
+		if (function == _FC_READ_COILS) {
+			tab_bits = mapping->tab_bits;
+			nb_bits  = mapping->nb_bits;
+		} else {
+			tab_bits = mapping->tab_input_bits;
+			nb_bits  = mapping->nb_input_bits;
+		}
+
+		if (nb < 1 || nb > MODBUS_MAX_READ_BITS) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else if ((address + nb) > nb_bits) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			// Nothing to read back from a broadcast
+			if (slave == MODBUS_BROADCAST_ADDRESS) return true;
 
 			rsp_length = build_response_basis(slave, function, rsp);
-			rsp[rsp_length++] = nb << 1;
-			for (i = address; i < address + nb; i++) {
-			    rsp[rsp_length++] = tab_reg[i] >> 8;
-				rsp[rsp_length++] = tab_reg[i] & 0xFF;
-			}
+			rsp[rsp_length++] = (nb + 7) >> 3;
+			modbus_read_bits(tab_bits, address, nb, rsp + rsp_length);
+			rsp_length += (nb + 7) >> 3;
+		}
+	}
+	break;
+
+	case _FC_DIAGNOSTICS: {
+		/* 1 and 2 = sub-function, 3 and 4 = data */
+		const uint16_t *counter = NULL;
+
+		switch (address) {
+		case _DIAG_RETURN_QUERY_DATA:
+			if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+			return true;
+
+		case _DIAG_CLEAR_COUNTERS:
+			// The event counter starts over from 0, the clear itself excluded
+			memset(&_counters, 0, sizeof(_counters));
+			if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+			return false;
+
+		case _DIAG_BUS_MESSAGE_COUNT:         counter = &_counters.bus_messages;   break;
+		case _DIAG_BUS_COMM_ERROR_COUNT:      counter = &_counters.bus_errors;     break;
+		case _DIAG_SLAVE_EXCEPTION_COUNT:     counter = &_counters.exceptions;     break;
+		case _DIAG_SLAVE_MESSAGE_COUNT:       counter = &_counters.slave_messages; break;
+		case _DIAG_SLAVE_NO_RESPONSE_COUNT:   counter = &_counters.no_responses;   break;
+		case _DIAG_BUS_CHAR_OVERRUN_COUNT:    counter = &_counters.overruns;       break;
+		}
+
+		if (counter == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+		} else if (nb != 0) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
 		} else {
-			uint16_t i, j;
+			rsp_length = build_response_basis(slave, function, rsp);
+			/* 2 to copy the sub-function */
+			memcpy(rsp + rsp_length, req + rsp_length, 2);
+			rsp_length += 2;
+			rsp[rsp_length++] = *counter >> 8;
+			rsp[rsp_length++] = *counter & 0xFF;
+		}
+	}
+	break;
+
+	case _FC_GET_COMM_EVENT_COUNTER:
+		rsp_length = build_response_basis(slave, function, rsp);
+		/* Status: no program command in progress */
+		rsp[rsp_length++] = 0;
+		rsp[rsp_length++] = 0;
+		rsp[rsp_length++] = _counters.events >> 8;
+		rsp[rsp_length++] = _counters.events & 0xFF;
 
-			for (i = address, j = 6; i < address + nb; i++, j += 2) {
-				/* 6 and 7 = first value */
-				tab_reg[i] = (req[_MODBUS_RTU_FUNCTION + j] << 8) + req[_MODBUS_RTU_FUNCTION + j + 1];
+		// Fetching the counter itself is not an event
+		if (slave != MODBUS_BROADCAST_ADDRESS) send_msg(rsp, rsp_length);
+		return false;
+
+	case _FC_WRITE_SINGLE_COIL:
+		if (address >= mapping->nb_bits) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else if (nb != 0xFF00 && nb != 0x0000) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else {
+			if (nb) {
+				mapping->tab_bits[address >> 3] |= 1 << (address & 7);
+			} else {
+				mapping->tab_bits[address >> 3] &= ~(1 << (address & 7));
 			}
 
+			// The response is an echo of the request
+			if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+			return true;
+		}
+	break;
+
+	case _FC_WRITE_SINGLE_REGISTER: {
+		modbus_segment_t whole;
+		const modbus_segment_t *segment = find_registers(mapping, address, 1, _DENIED_WRITE, &whole);
+
+		if (segment == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			/* 3 and 4 = value */
+			write_registers(mapping, segment, address, 1, req + _MODBUS_RTU_FUNCTION + 3);
+
+			// The response is an echo of the request
+			if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+			return true;
+		}
+	}
+	break;
+
+	case _FC_WRITE_MULTIPLE_COILS:
+		if (nb < 1 || nb > MODBUS_MAX_WRITE_BITS || req[_MODBUS_RTU_FUNCTION + 5] != ((nb + 7) >> 3)) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else if ((address + nb) > mapping->nb_bits) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			/* 6 = first byte of values */
+			modbus_write_bits(mapping->tab_bits, address, nb, req + _MODBUS_RTU_FUNCTION + 6);
+
+			rsp_length = build_response_basis(slave, function, rsp);
+			/* 4 to copy the address (2) and the no. of coils */
+			memcpy(rsp + rsp_length, req + rsp_length, 4);
+			rsp_length += 4;
+		}
+	break;
+
+	case _FC_READ_HOLDING_REGISTERS:
+	case _FC_READ_INPUT_REGISTERS: {
+		modbus_segment_t whole;
+		const modbus_segment_t *segment;
+
+		if (function == _FC_READ_HOLDING_REGISTERS) {
+			segment = find_registers(mapping, address, nb, _DENIED_READ, &whole);
+		} else {
+			segment = find_input_registers(mapping, address, nb, &whole);
+		}
+
+		if (nb < 1 || nb > MODBUS_MAX_READ_REGISTERS) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else if (segment == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			// Nothing to read back from a broadcast
+			if (slave == MODBUS_BROADCAST_ADDRESS) return true;
+
+			// The request is valid, stream the registers without building
+			// the response first
+			send_registers(slave, function, segment, address, nb, mapping->lock);
+			return true;
+		}
+	}
+	break;
+
+	case _FC_WRITE_MULTIPLE_REGISTERS: {
+		modbus_segment_t whole;
+		const modbus_segment_t *segment = find_registers(mapping, address, nb, _DENIED_WRITE, &whole);
+
+		if (nb < 1 || nb > MODBUS_MAX_WRITE_REGISTERS || req[_MODBUS_RTU_FUNCTION + 5] != (nb << 1)) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else if (segment == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			/* 6 and 7 = first value */
+			write_registers(mapping, segment, address, nb, req + _MODBUS_RTU_FUNCTION + 6);
+
 			rsp_length = build_response_basis(slave, function, rsp);
 			/* 4 to copy the address (2) and the no. of registers */
 			memcpy(rsp + rsp_length, req + rsp_length, 4);
 			rsp_length += 4;
 		}
 	}
+	break;
+
+	case _FC_MASK_WRITE_REGISTER: {
+		modbus_segment_t whole;
+		const modbus_segment_t *segment = find_registers(mapping, address, 1, _DENIED_READ | _DENIED_WRITE, &whole);
+
+		if (segment == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			/* 3 and 4 = AND mask, 5 and 6 = OR mask */
+			uint16_t and_mask = nb;
+			uint16_t or_mask  = (req[_MODBUS_RTU_FUNCTION + 5] << 8) + req[_MODBUS_RTU_FUNCTION + 6];
+			uint16_t offset   = address - segment->address;
+			uint16_t value;
+
+			if (segment->on_read) segment->on_read(segment, address, 1);
+			if (mapping->lock) mapping->lock->writeBegin();
+			value = modbus_segment_get(segment, offset);
+			modbus_segment_set(segment, offset, (value & and_mask) | (or_mask & ~and_mask));
+			if (mapping->lock) mapping->lock->writeEnd();
+			segment_written(segment, address, 1);
+			if (mapping->changes) mapping->changes->push(address, 1);
+
+			// The response is an echo of the request
+			if (slave != MODBUS_BROADCAST_ADDRESS) send_echo(req, req_length);
+			return true;
+		}
+	}
+	break;
+
+	case _FC_WRITE_AND_READ_REGISTERS: {
+		uint16_t address_write = (req[_MODBUS_RTU_FUNCTION + 5] << 8) + req[_MODBUS_RTU_FUNCTION + 6];
+		uint16_t nb_write      = (req[_MODBUS_RTU_FUNCTION + 7] << 8) + req[_MODBUS_RTU_FUNCTION + 8];
+		modbus_segment_t whole;
+		const modbus_segment_t *segment       = find_registers(mapping, address, nb, _DENIED_READ, &whole);
+		const modbus_segment_t *segment_write = find_registers(mapping, address_write, nb_write, _DENIED_WRITE, &whole);
+
+		if (nb < 1 || nb > MODBUS_MAX_WR_READ_REGISTERS ||
+		    nb_write < 1 || nb_write > MODBUS_MAX_WR_WRITE_REGISTERS ||
+		    req[_MODBUS_RTU_FUNCTION + 9] != (nb_write << 1)) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else if (segment == NULL || segment_write == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else {
+			// The write operation is performed before the read
+			/* 10 and 11 = first value */
+			write_registers(mapping, segment_write, address_write, nb_write, req + _MODBUS_RTU_FUNCTION + 10);
+
+			if (slave == MODBUS_BROADCAST_ADDRESS) return true;
+			send_registers(slave, function, segment, address, nb, mapping->lock);
+			return true;
+		}
+	}
+	break;
+
+	case _FC_READ_FILE_RECORD:
+	case _FC_WRITE_FILE_RECORD:
+		if (mapping->files == NULL) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+		} else {
+			uint8_t rc;
+
+			if (function == _FC_READ_FILE_RECORD) {
+				rc = reply_read_file_record(mapping->files, req);
+			} else {
+				rc = reply_write_file_record(mapping->files, req, req_length);
+			}
+			if (rc == 0) return true;
+			rsp_length = response_exception(slave, function, rc, rsp);
+		}
+	break;
+
+	case _FC_READ_FIFO_QUEUE:
+		/* 1 and 2 = FIFO pointer address */
+		if (address >= mapping->nb_fifos) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		} else if (mapping->tab_fifos[address]->count() > MODBUS_MAX_FIFO_COUNT) {
+			// The queue is left untouched, as the specification requires
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else {
+			// Nothing to read back from a broadcast
+			if (slave == MODBUS_BROADCAST_ADDRESS) return true;
+
+			// Drains the whole queue, the values pushed meanwhile are left
+			// for the next request
+			ModbusFifo *fifo = mapping->tab_fifos[address];
+			uint8_t count = fifo->count();
+			uint8_t i;
+
+			if (count > MODBUS_MAX_FIFO_COUNT) count = MODBUS_MAX_FIFO_COUNT;
+
+			send_begin();
+			send_byte(slave);
+			send_byte(function);
+			send_byte(0);
+			send_byte(2 + (count << 1));
+			send_byte(0);
+			send_byte(count);
+			for (i = 0; i < count; i++) {
+				uint16_t value = fifo->peek(i);
+				send_byte(value >> 8);
+				send_byte(value & 0xFF);
+			}
+			send_end();
 
-	send_msg(rsp, rsp_length);
+			fifo->consume(count);
+			return true;
+		}
+	break;
+
+	case _FC_ENCAPSULATED_INTERFACE:
+		if (req[_MODBUS_RTU_FUNCTION + 1] != _MEI_READ_DEVICE_ID) {
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+		} else {
+			/* 2 = read device ID code, 3 = object id */
+			uint8_t rc = send_device_identification(slave, req[_MODBUS_RTU_FUNCTION + 2], req[_MODBUS_RTU_FUNCTION + 3]);
+			if (rc == 0) return true;
+			rsp_length = response_exception(slave, function, rc, rsp);
+		}
+	break;
+
+	default: {
+		uint8_t index = function_index(function);
+		int rc;
+
+		if (index == 0) {
+			// The frame length is known but the function is not supported
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+			break;
+		}
+
+		modbus_function_handler_t handler =
+			(modbus_function_handler_t) pgm_read_ptr(&_functions[index - 1].handler);
+		rc = handler(mapping, req + _MODBUS_RTU_FUNCTION, req_length - _MODBUS_RTU_FUNCTION,
+		             rsp + _MODBUS_RTU_PRESET_RSP_LENGTH);
+		if (rc < 0) {
+			rsp_length = response_exception(slave, function, -rc, rsp);
+		} else if (rc > MODBUS_MAX_PDU_LENGTH - 1) {
+			// The data would not fit a response after the function code
+			rsp_length = response_exception(slave, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		} else {
+			rsp_length = build_response_basis(slave, function, rsp) + rc;
+		}
+	}
+	}
+
+	// Broadcast requests are executed but never answered, the other slaves
+	// would collide with us
+	if (slave != MODBUS_BROADCAST_ADDRESS) {
+		send_msg(rsp, rsp_length);
+	}
+	return !(rsp[_MODBUS_RTU_FUNCTION] & 0x80);
+}
+
+const modbus_counters_t *SimpleModbusSlave::counters(void) {
+	return &_counters;
+}
+
+void SimpleModbusSlave::setDeviceIdentification(const modbus_device_id_t *objects, uint8_t nb_objects) {
+	_device_id = objects;
+	_nb_device_id = nb_objects;
+}
+
+// The byte count of a frame, when there is one, must be among its meta bytes
+static bool valid_frame_rule(uint8_t rule) {
+	return (rule >> 4) <= (rule & 0x0F);
+}
+
+// Function codes served by reply() itself
+static bool builtin_function(uint8_t function) {
+	switch (function) {
+	case _FC_READ_COILS:
+	case _FC_READ_DISCRETE_INPUTS:
+	case _FC_READ_HOLDING_REGISTERS:
+	case _FC_READ_INPUT_REGISTERS:
+	case _FC_WRITE_SINGLE_COIL:
+	case _FC_WRITE_SINGLE_REGISTER:
+	case _FC_DIAGNOSTICS:
+	case _FC_GET_COMM_EVENT_COUNTER:
+	case _FC_WRITE_MULTIPLE_COILS:
+	case _FC_WRITE_MULTIPLE_REGISTERS:
+	case _FC_READ_FILE_RECORD:
+	case _FC_WRITE_FILE_RECORD:
+	case _FC_MASK_WRITE_REGISTER:
+	case _FC_WRITE_AND_READ_REGISTERS:
+	case _FC_READ_FIFO_QUEUE:
+	case _FC_ENCAPSULATED_INTERFACE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Registers the functions of a table, replacing the previous ones. Returns
+// false, registering nothing, when a function code is invalid or implemented
+// by the library, or when a frame rule is invalid.
+bool SimpleModbusSlave::setFunctions(const modbus_function_t *functions, uint8_t nb_functions) {
+	uint8_t i, function;
+
+	if (nb_functions > MODBUS_MAX_FUNCTIONS) return false;
+	for (i = 0; i < nb_functions; i++) {
+		function = pgm_read_byte(&functions[i].function);
+		if (function == 0 || (function & 0x80) || builtin_function(function)) return false;
+		if (!valid_frame_rule(pgm_read_byte(&functions[i].request_rule)) ||
+		    !valid_frame_rule(pgm_read_byte(&functions[i].response_rule))) {
+			return false;
+		}
+	}
+
+	memset(_functions_index, 0, sizeof(_functions_index));
+	_functions = functions;
+	for (i = 0; i < nb_functions; i++) {
+		function = pgm_read_byte(&functions[i].function);
+		_functions_index[function >> 1] &= 0xF0 >> ((function & 1) << 2);
+		_functions_index[function >> 1] |= (i + 1) << ((function & 1) << 2);
+	}
+	return true;
 }
 
 int SimpleModbusSlave::loop(uint16_t* tab_reg, uint16_t nb_reg) {
+	return loop(tab_reg, nb_reg, NULL, 0);
+}
+
+int SimpleModbusSlave::loop(uint16_t* tab_reg, uint16_t nb_reg, uint16_t *tab_input_reg, uint16_t nb_input_reg) {
+	_mapping.tab_registers       = tab_reg;
+	_mapping.nb_registers        = nb_reg;
+	_mapping.tab_input_registers = tab_input_reg;
+	_mapping.nb_input_registers  = nb_input_reg;
+	return loop();
+}
+
+int SimpleModbusSlave::loop(void) {
 	int rc = 0;
 	uint8_t req[_MODBUSINO_RTU_MAX_ADU_LENGTH];
 
-	if (Serial2.available()) {
-		rc = receive(req, _slave);
+	if (_serial->available()) {
+		rc = receive(req);
 		if (rc > 0) {
-			reply(tab_reg, nb_reg, req, rc, _slave);
+			uint8_t slave = req[_MODBUS_RTU_SLAVE];
+
+			bool done = true;
+
+			if (slave == MODBUS_BROADCAST_ADDRESS) {
+				// Every served slave applies the broadcast silently, it is
+				// one event when all of them succeed
+				_counters.no_responses++;
+				for (uint8_t i = 0; i < _nb_slaves; i++) {
+					done &= reply(_mappings[i], req, rc);
+				}
+			} else {
+				done = reply(_mappings[slave_index(slave) - 1], req, rc);
+			}
+			if (done) _counters.events++;
 		}
 	}
 
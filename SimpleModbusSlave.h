@@ -21,8 +21,50 @@
 #endif
 
 #include "crc16.h"
+#include "modbus_bits.h"
+#include "modbus_registers.h"
+#include "modbus_fifo.h"
+#include "modbus_file.h"
+#include "modbus_segment.h"
+#include "modbus_seqlock.h"
+#include "modbus_journal.h"
+#include "modbus_changes.h"
 
 #define MODBUS_BROADCAST_ADDRESS 0
+#define MODBUS_MAX_SLAVE_ADDRESS 247
+
+/* Number of slave addresses a device can answer to */
+#define MODBUS_MAX_SLAVES 15
+
+/* Protocol limits */
+#define MODBUS_MAX_READ_BITS      2000
+#define MODBUS_MAX_WRITE_BITS     1968
+#define MODBUS_MAX_READ_REGISTERS 125
+#define MODBUS_MAX_WRITE_REGISTERS 123
+#define MODBUS_MAX_WR_WRITE_REGISTERS 121
+#define MODBUS_MAX_WR_READ_REGISTERS 125
+#define MODBUS_MAX_PDU_LENGTH 253
+#define MODBUS_MAX_FIFO_COUNT 31
+
+/* Silence, in milliseconds, after which the answer to a request for another
+ * slave is no longer expected: the slave is offline and the master may repeat
+ * its request. It must stay below the response timeout of the master. */
+#ifndef MODBUS_CONFIRMATION_TIMEOUT
+#define MODBUS_CONFIRMATION_TIMEOUT 100
+#endif
+
+/* Number of user functions a device can register, see setFunctions() */
+#define MODBUS_MAX_FUNCTIONS 15
+
+/* Device identification objects, see the read device identification
+ * function (0x2B / 0x0E) */
+#define MODBUS_DEVICE_ID_VENDOR_NAME          0x00
+#define MODBUS_DEVICE_ID_PRODUCT_CODE         0x01
+#define MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION 0x02
+#define MODBUS_DEVICE_ID_VENDOR_URL           0x03
+#define MODBUS_DEVICE_ID_PRODUCT_NAME         0x04
+#define MODBUS_DEVICE_ID_MODEL_NAME           0x05
+#define MODBUS_DEVICE_ID_USER_APPLICATION     0x06
 
 /* Protocol exceptions */
 #define MODBUS_EXCEPTION_ILLEGAL_FUNCTION     1
@@ -31,14 +73,144 @@
 #define MODBUS_INFORMATIVE_NOT_FOR_US   4
 #define MODBUS_INFORMATIVE_RX_TIMEOUT   5
 
+typedef struct {
+    uint16_t nb_registers;
+    uint16_t *tab_registers;
+    uint16_t nb_input_registers;
+    uint16_t *tab_input_registers;
+    uint16_t nb_bits;             /* Coils, packed eight per byte */
+    uint8_t *tab_bits;
+    uint16_t nb_input_bits;       /* Discrete inputs, packed eight per byte */
+    uint8_t *tab_input_bits;
+    uint16_t nb_fifos;            /* Queues, the FIFO pointer address is the index */
+    ModbusFifo **tab_fifos;
+    ModbusFileStore *files;       /* Files of the file record functions */
+    /* Holding registers split in address ranges, used instead of
+     * nb_registers and tab_registers when set */
+    uint16_t nb_segments;
+    const modbus_segment_t *segments;
+    uint16_t nb_input_segments;   /* The same for the input registers */
+    const modbus_segment_t *input_segments;
+    uint8_t *tab_dirty_registers; /* Holding registers written by a master, one
+                                   * bit each, see modbus_take_bits() */
+    ModbusSeqlock *lock;          /* Consistent reads of the registers while
+                                   * another core writes them */
+    ModbusChangeQueue *changes;   /* Holding registers written by a master, one
+                                   * change per request */
+} modbus_mapping_t;
+
+/* Communication counters, see the diagnostics function (0x08) */
+typedef struct {
+    uint16_t bus_messages;        /* Frames detected on the bus */
+    uint16_t bus_errors;          /* CRC errors */
+    uint16_t exceptions;          /* Exception responses */
+    uint16_t slave_messages;      /* Requests addressed to us, broadcasts included */
+    uint16_t no_responses;        /* Requests not answered (broadcasts) */
+    uint16_t overruns;            /* Frames longer than the receive buffer */
+    uint16_t events;              /* Requests completed successfully, see the
+                                   * comm event counter (0x0B) */
+} modbus_counters_t;
+
+/* Device identification object. The tables of objects, sorted by id, and
+ * their values are meant to be stored in flash (PROGMEM) */
+typedef struct {
+    uint8_t id;
+    const char *value;
+} modbus_device_id_t;
+
+/* Length of a frame after its function code: a fixed number of meta bytes,
+ * optionally followed by as many data bytes as announced by the byte count
+ * found at a given position after the function code, from 1 to meta, or 0
+ * when there is none */
+constexpr uint8_t modbus_frame_rule(uint8_t meta, uint8_t count_position) {
+    return (count_position << 4) | meta;
+}
+
+#define MODBUS_FRAME_RULE_UNKNOWN 0xFF
+
+/* Handler of a user function. req is the request PDU, function code first,
+ * the data of the response is written after its function code in rsp, at most
+ * MODBUS_MAX_PDU_LENGTH - 1 (252) bytes. Returns the length of the data
+ * written or minus an exception code, a longer length being answered with an
+ * ILLEGAL_DATA_VALUE exception. */
+typedef int (*modbus_function_handler_t)(modbus_mapping_t *mapping, const uint8_t *req, uint8_t req_length, uint8_t *rsp);
+
+/* User function. The tables of functions are meant to be stored in flash
+ * (PROGMEM) */
+typedef struct {
+    uint8_t function;
+    uint8_t request_rule;         /* See modbus_frame_rule() */
+    uint8_t response_rule;
+    modbus_function_handler_t handler;
+} modbus_function_t;
+
 class SimpleModbusSlave {
 public:
-    SimpleModbusSlave(uint8_t slave);
+    SimpleModbusSlave(uint8_t slave, HardwareSerial &serial = Serial2);
     void setup(long baud, int  RS485DE_Pin);
+    bool addSlave(uint8_t slave, modbus_mapping_t *mapping);
     int loop(uint16_t *tab_reg, uint16_t nb_reg);
+    int loop(uint16_t *tab_reg, uint16_t nb_reg, uint16_t *tab_input_reg, uint16_t nb_input_reg);
+    int loop(void);
+    const modbus_counters_t *counters(void);
+    void setDeviceIdentification(const modbus_device_id_t *objects, uint8_t nb_objects);
+    bool setFunctions(const modbus_function_t *functions, uint8_t nb_functions);
 private:
-    int _slave;
+    uint8_t slave_index(uint8_t slave);
+    uint8_t function_index(uint8_t function);
+    uint8_t frame_rule(uint8_t function, uint8_t msg_type);
+    int receive(uint8_t *req);
+    bool reply(modbus_mapping_t *mapping, uint8_t *req, uint16_t req_length);
+    void send_registers(uint8_t slave, uint8_t function, const modbus_segment_t *segment, uint16_t address, uint16_t nb,
+                        const ModbusSeqlock *lock);
+    void send_locked_registers(uint8_t slave, uint8_t function, const modbus_segment_t *segment, uint16_t address,
+                               uint16_t nb, const ModbusSeqlock *lock);
+    void write_registers(modbus_mapping_t *mapping, const modbus_segment_t *segment, uint16_t address, uint16_t nb,
+                         const uint8_t *values);
+    uint8_t send_device_identification(uint8_t slave, uint8_t code, uint8_t object_id);
+    uint8_t reply_read_file_record(ModbusFileStore *files, uint8_t *req);
+    uint8_t reply_write_file_record(ModbusFileStore *files, uint8_t *req, uint16_t req_length);
+    void flush(void);
+    void send_begin(void);
+    void send_byte(uint8_t c);
+    void send_bytes(const uint8_t *data, uint8_t length);
+    void send_end(void);
+    void send_msg(uint8_t *msg, uint8_t msg_length);
+    void send_echo(uint8_t *req, uint16_t req_length);
+    uint8_t response_exception(uint8_t slave, uint8_t function, uint8_t exception_code, uint8_t *rsp);
+
+    HardwareSerial *_serial;
     int _pin_DE;
+
+    // Served slave addresses, one nibble for each of the 256 addresses, see
+    // slave_index()
+    uint8_t _slaves[128];
+    uint8_t _nb_slaves;
+    modbus_mapping_t *_mappings[MODBUS_MAX_SLAVES];
+
+    // Mapping of the slave given to the constructor, see loop(tab_reg, nb_reg)
+    modbus_mapping_t _mapping;
+
+    // CRC of the response being transmitted
+    uint16_t _send_crc;
+
+    // Slave and function of the confirmation expected to follow the last
+    // request addressed to another slave, MODBUS_BROADCAST_ADDRESS when none
+    // is pending
+    uint8_t _confirmation_slave;
+    uint8_t _confirmation_function;
+    unsigned long _confirmation_time;
+
+    modbus_counters_t _counters;
+
+    // Device identification objects, in flash
+    const modbus_device_id_t *_device_id;
+    uint8_t _nb_device_id;
+
+    // User functions, in flash, and their index, one nibble for each of the
+    // 128 function codes, see function_index()
+    const modbus_function_t *_functions;
+    uint8_t _functions_index[64];
 };
 
 #endif /* SimpleModbusSlave_h */
@@ -55,18 +55,22 @@ const uint16_t CRCTable[] PROGMEM = {
 	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
 };
 
-uint16_t crc16(uint8_t *data, uint8_t length) {
-	uint16_t crc = 0xFFFF;
+uint16_t crc16_update(uint16_t crc, uint8_t data) {
+	uint8_t temp = data ^ LOBYTE(crc);
+	return (crc >> 8) ^ pgm_read_word_near(CRCTable + temp);
+}
+
+uint16_t crc16(uint8_t *data, uint16_t length) {
+	uint16_t crc = CRC16_INITIAL_VALUE;
 
 	while (length--) {
-		uint8_t temp = *(data++) ^ LOBYTE(crc);
-		crc = (crc >> 8) ^ pgm_read_word_near(CRCTable + temp);
+		crc = crc16_update(crc, *(data++));
 	}
 
 	return crc;
 }
 
-void add_crc16(uint8_t *data, uint8_t length) {
+void add_crc16(uint8_t *data, uint16_t length) {
 	uint16_t crc = crc16(data, length);
 
 	data[length++] = LOBYTE(crc);
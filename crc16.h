@@ -14,7 +14,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
-extern uint16_t crc16(uint8_t *data, uint8_t length);
-extern void add_crc16(uint8_t *data, uint8_t length);
+#define CRC16_INITIAL_VALUE 0xFFFF
+
+extern uint16_t crc16_update(uint16_t crc, uint8_t data);
+extern uint16_t crc16(uint8_t *data, uint16_t length);
+extern void add_crc16(uint8_t *data, uint16_t length);
 
 #endif /* CRC16_h */
@@ -0,0 +1,152 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include <string.h>
+
+#include "modbus_bits.h"
+
+// Unaligned ranges are shifted a machine word at a time. The words are loaded
+// and stored little-endian, so other targets fall back to bytes.
+#if defined(__AVR__) || !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+typedef uint8_t bits_word_t;
+#else
+typedef uint32_t bits_word_t;
+#endif
+
+#define WORD_SIZE sizeof(bits_word_t)
+#define WORD_BITS (8 * sizeof(bits_word_t))
+
+void modbus_read_bits(const uint8_t *tab_bits, uint16_t address, uint16_t nb, uint8_t *dest) {
+	const uint8_t *src = tab_bits + (address >> 3);
+	uint8_t shift = address & 7;
+	uint16_t length = (nb + 7) >> 3;         // Bytes to produce
+	uint16_t last = (shift + nb - 1) >> 3;   // Last source byte holding a bit
+	uint16_t i = 0;
+
+	if (nb == 0) return;
+
+	if (shift == 0) {
+		memcpy(dest, src, length);
+	} else {
+		// Each word is completed by the low bits of the byte following it
+		for (; i + WORD_SIZE <= last; i += WORD_SIZE) {
+			bits_word_t w;
+			memcpy(&w, src + i, WORD_SIZE);
+			w = (w >> shift) | ((bits_word_t) src[i + WORD_SIZE] << (WORD_BITS - shift));
+			memcpy(dest + i, &w, WORD_SIZE);
+		}
+
+		for (; i < length; i++) {
+			uint8_t b = src[i] >> shift;
+			if (i < last) b |= src[i + 1] << (8 - shift);
+			dest[i] = b;
+		}
+	}
+
+	if (nb & 7) {
+		dest[length - 1] &= (1 << (nb & 7)) - 1;
+	}
+}
+
+void modbus_write_bits(uint8_t *tab_bits, uint16_t address, uint16_t nb, const uint8_t *src) {
+	uint8_t *dst = tab_bits + (address >> 3);
+	uint8_t shift = address & 7;
+	uint16_t length = (nb + 7) >> 3;         // Bytes of src
+	uint16_t last = (shift + nb - 1) >> 3;   // Last destination byte
+	uint8_t head_mask = 0xFF << shift;
+	uint8_t tail_mask = 0xFF >> (7 - ((shift + nb - 1) & 7));
+	uint8_t b;
+	uint16_t i;
+
+	if (nb == 0) return;
+
+	if (last == 0) {
+		head_mask &= tail_mask;
+		dst[0] = (dst[0] & ~head_mask) | ((src[0] << shift) & head_mask);
+		return;
+	}
+
+	// First byte, keeping the bits below address
+	dst[0] = (dst[0] & ~head_mask) | (uint8_t) (src[0] << shift);
+
+	// Whole bytes, each made of the high bits of the previous source byte and
+	// the low bits of the current one
+	i = 1;
+	if (shift == 0) {
+		memcpy(dst + 1, src + 1, last - 1);
+		i = last;
+	} else {
+		for (; i + WORD_SIZE <= last; i += WORD_SIZE) {
+			bits_word_t w;
+			memcpy(&w, src + i - 1, WORD_SIZE);
+			w = (w >> (8 - shift)) | ((bits_word_t) src[i + WORD_SIZE - 1] << (WORD_BITS - 8 + shift));
+			memcpy(dst + i, &w, WORD_SIZE);
+		}
+
+		for (; i < last; i++) {
+			dst[i] = (src[i] << shift) | (src[i - 1] >> (8 - shift));
+		}
+	}
+
+	// Last byte, keeping the bits after the range
+	b = src[i - 1] >> (8 - shift);
+	if (i < length) b |= src[i] << shift;
+	dst[i] = (dst[i] & ~tail_mask) | (b & tail_mask);
+}
+
+void modbus_set_bits(uint8_t *tab_bits, uint16_t address, uint16_t nb) {
+	uint32_t end = (uint32_t) address + nb;
+
+	if (nb == 0) return;
+
+	// Bits up to the next byte boundary, whole bytes, then the rest
+	for (; address < end && (address & 7); address++) {
+		tab_bits[address >> 3] |= 1 << (address & 7);
+	}
+	if ((uint32_t) address + 8 <= end) {
+		memset(tab_bits + (address >> 3), 0xFF, (end - address) >> 3);
+		address += (end - address) & ~7;
+	}
+	for (; address < end; address++) {
+		tab_bits[address >> 3] |= 1 << (address & 7);
+	}
+}
+
+uint16_t modbus_take_bits(uint8_t *tab_bits, uint16_t nb_bits, uint16_t *address) {
+	uint16_t i = *address;
+	uint16_t nb = 0;
+
+	// Skip the clear bytes at once
+	while (i < nb_bits) {
+		if ((i & 7) == 0 && tab_bits[i >> 3] == 0) {
+			i += 8;
+		} else if (tab_bits[i >> 3] & (1 << (i & 7))) {
+			break;
+		} else {
+			i++;
+		}
+	}
+	if (i >= nb_bits) return 0;
+
+	*address = i;
+	while (i < nb_bits) {
+		if ((i & 7) == 0 && tab_bits[i >> 3] == 0xFF && i + 8 <= nb_bits) {
+			tab_bits[i >> 3] = 0;
+			i += 8;
+			nb += 8;
+		} else if (tab_bits[i >> 3] & (1 << (i & 7))) {
+			tab_bits[i >> 3] &= ~(1 << (i & 7));
+			i++;
+			nb++;
+		} else {
+			break;
+		}
+	}
+
+	return nb;
+}
@@ -0,0 +1,34 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_BITS_h
+#define MODBUS_BITS_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Coils and discrete inputs are stored packed, eight per byte, the first one
+// in the least significant bit, like in the Modbus frames.
+
+// Copies nb bits starting at bit address of tab_bits to dest, starting at
+// its first bit. The unused bits of the last byte of dest are cleared.
+extern void modbus_read_bits(const uint8_t *tab_bits, uint16_t address, uint16_t nb, uint8_t *dest);
+
+// Copies nb bits starting at the first bit of src to tab_bits, starting at
+// bit address. The surrounding bits of tab_bits are left untouched.
+extern void modbus_write_bits(uint8_t *tab_bits, uint16_t address, uint16_t nb, const uint8_t *src);
+
+// Sets nb bits of tab_bits starting at bit address.
+extern void modbus_set_bits(uint8_t *tab_bits, uint16_t address, uint16_t nb);
+
+// Finds the first run of set bits at or after bit *address among the nb_bits
+// of tab_bits, clears it and stores its first bit in *address. Returns the
+// length of the run, 0 when no bit is set.
+extern uint16_t modbus_take_bits(uint8_t *tab_bits, uint16_t nb_bits, uint16_t *address);
+
+#endif /* MODBUS_BITS_h */
@@ -0,0 +1,58 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include "modbus_changes.h"
+
+ModbusChangeQueue::ModbusChangeQueue(modbus_change_t *buffer, uint8_t size, void (*notify)(void)) {
+	_buffer = buffer;
+	_mask = size - 1;
+	_notify = notify;
+	_head = 0;
+	_tail = 0;
+	_overflows = 0;
+	_overflows_seen = 0;
+}
+
+bool ModbusChangeQueue::push(uint16_t address, uint16_t nb) {
+	uint8_t head = _head;
+	bool pushed = (uint8_t) (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) <= _mask;
+
+	if (pushed) {
+		_buffer[head & _mask].address = address;
+		_buffer[head & _mask].nb = nb;
+
+		// Publish the change only once it is stored
+		__atomic_store_n(&_head, (uint8_t) (head + 1), __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&_overflows, (uint8_t) (_overflows + 1), __ATOMIC_RELEASE);
+	}
+
+	// The application is woken up by a lost change as well
+	if (_notify) _notify();
+	return pushed;
+}
+
+bool ModbusChangeQueue::pop(modbus_change_t *change) {
+	uint8_t tail = _tail;
+
+	if (__atomic_load_n(&_head, __ATOMIC_ACQUIRE) == tail) return false;
+
+	*change = _buffer[tail & _mask];
+
+	// Free the slot only once it is read
+	__atomic_store_n(&_tail, (uint8_t) (tail + 1), __ATOMIC_RELEASE);
+	return true;
+}
+
+bool ModbusChangeQueue::overflowed(void) {
+	uint8_t overflows = __atomic_load_n(&_overflows, __ATOMIC_ACQUIRE);
+
+	if (overflows == _overflows_seen) return false;
+	_overflows_seen = overflows;
+	return true;
+}
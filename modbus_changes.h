@@ -0,0 +1,56 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_CHANGES_h
+#define MODBUS_CHANGES_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Holding registers written by a single request
+typedef struct {
+    uint16_t address;
+    uint16_t nb;
+} modbus_change_t;
+
+// Lock-free single producer, single consumer queue of the holding registers
+// written by the masters. The slave pushes a change once the registers are
+// stored; the application, on another core or task, pops the changes instead
+// of comparing the registers to a copy. notify, when given, is called after
+// each push to wake the application up.
+//
+// The buffer size must be a power of two, at most 128.
+class ModbusChangeQueue {
+public:
+    ModbusChangeQueue(modbus_change_t *buffer, uint8_t size, void (*notify)(void) = NULL);
+
+    // Producer side, returns false when the queue is full and the change is
+    // lost
+    bool push(uint16_t address, uint16_t nb);
+
+    // Consumer side, returns false when the queue is empty
+    bool pop(modbus_change_t *change);
+
+    // True, once, when changes were lost since the previous call: any
+    // register may have changed
+    bool overflowed(void);
+
+private:
+    modbus_change_t *_buffer;
+    uint8_t _mask;
+    void (*_notify)(void);
+
+    // Free running indexes and counts of lost changes, each written by one
+    // side only, so that byte loads and stores are enough even on AVR
+    uint8_t _head;
+    uint8_t _tail;
+    uint8_t _overflows;
+    uint8_t _overflows_seen;
+};
+
+#endif /* MODBUS_CHANGES_h */
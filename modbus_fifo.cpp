@@ -0,0 +1,42 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include "modbus_fifo.h"
+
+ModbusFifo::ModbusFifo(uint16_t *buffer, uint8_t size) {
+	_buffer = buffer;
+	_mask = size - 1;
+	_head = 0;
+	_tail = 0;
+}
+
+bool ModbusFifo::push(uint16_t value) {
+	uint8_t head = _head;
+
+	if ((uint8_t) (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) > _mask) return false;
+
+	_buffer[head & _mask] = value;
+
+	// Publish the value only once it is stored
+	__atomic_store_n(&_head, (uint8_t) (head + 1), __ATOMIC_RELEASE);
+	return true;
+}
+
+uint8_t ModbusFifo::count(void) {
+	return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+}
+
+// Value at index from the oldest one, index being below count()
+uint16_t ModbusFifo::peek(uint8_t index) {
+	return _buffer[(uint8_t) (_tail + index) & _mask];
+}
+
+// Releases the nb oldest values in a single store
+void ModbusFifo::consume(uint8_t nb) {
+	__atomic_store_n(&_tail, (uint8_t) (_tail + nb), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_FIFO_h
+#define MODBUS_FIFO_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single producer, single consumer queue of register values served
+// by the read FIFO queue function (0x18). The application (or an interrupt
+// handler) pushes samples, the slave drains them.
+//
+// The buffer size must be a power of two, at most 128.
+class ModbusFifo {
+public:
+    ModbusFifo(uint16_t *buffer, uint8_t size);
+
+    // Producer side, returns false when the queue is full
+    bool push(uint16_t value);
+
+    // Consumer side
+    uint8_t count(void);
+    uint16_t peek(uint8_t index);
+    void consume(uint8_t nb);
+
+private:
+    uint16_t *_buffer;
+    uint8_t _mask;
+
+    // Free running indexes, each written by one side only
+    uint8_t _head;
+    uint8_t _tail;
+};
+
+#endif /* MODBUS_FIFO_h */
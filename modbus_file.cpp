@@ -0,0 +1,104 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include <string.h>
+
+#include "modbus_file.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ModbusMemoryFileStore::ModbusMemoryFileStore(uint8_t *data, uint32_t size, uint16_t records_per_file) {
+	_data = data;
+	_size = size;
+	_records_per_file = records_per_file;
+	_read_only = false;
+}
+
+ModbusMemoryFileStore::ModbusMemoryFileStore(const uint8_t *data, uint32_t size, uint16_t records_per_file) {
+	_data = (uint8_t *) data;
+	_size = size;
+	_records_per_file = records_per_file;
+	_read_only = true;
+}
+
+uint8_t *ModbusMemoryFileStore::locate(uint16_t file, uint16_t record, uint16_t nb) {
+	uint32_t offset;
+
+	if (file == 0 || (uint32_t) record + nb > _records_per_file) return NULL;
+
+	offset = ((uint32_t) (file - 1) * _records_per_file + record) * 2;
+	if (_data == NULL || offset + nb * 2 > _size) return NULL;
+
+	return _data + offset;
+}
+
+const uint8_t *ModbusMemoryFileStore::read(uint16_t file, uint16_t record, uint16_t nb) {
+	return locate(file, record, nb);
+}
+
+bool ModbusMemoryFileStore::write(uint16_t file, uint16_t record, uint16_t nb, const uint8_t *data) {
+	uint8_t *records = locate(file, record, nb);
+
+	if (records == NULL || _read_only) return false;
+
+	memcpy(records, data, nb * 2);
+	return true;
+}
+
+bool ModbusMemoryFileStore::writable(uint16_t file, uint16_t record, uint16_t nb) {
+	return !_read_only && locate(file, record, nb) != NULL;
+}
+
+#if defined(__linux__)
+ModbusMappedFileStore::ModbusMappedFileStore(uint16_t records_per_file)
+	: ModbusMemoryFileStore((uint8_t *) NULL, 0, records_per_file) {
+}
+
+ModbusMappedFileStore::~ModbusMappedFileStore() {
+	close();
+}
+
+bool ModbusMappedFileStore::open(const char *path, bool read_only) {
+	struct stat st;
+	void *data;
+	int fd;
+
+	close();
+
+	fd = ::open(path, read_only ? O_RDONLY : O_RDWR);
+	if (fd < 0) return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	// The mapping keeps the file referenced, the descriptor is not needed
+	data = mmap(NULL, st.st_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) return false;
+
+	_data = (uint8_t *) data;
+	_size = st.st_size;
+	_read_only = read_only;
+	return true;
+}
+
+void ModbusMappedFileStore::close(void) {
+	if (_data != NULL) {
+		munmap(_data, _size);
+		_data = NULL;
+		_size = 0;
+	}
+}
+#endif
@@ -0,0 +1,71 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_FILE_h
+#define MODBUS_FILE_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Records of a file are numbered from 0 to 9999 */
+#define MODBUS_MAX_FILE_RECORDS 10000
+
+// Storage of the files served by the read and write file record functions
+// (0x14 / 0x15). A record is a 16 bits value, stored big-endian as on the
+// wire so the records can be sent without conversion.
+class ModbusFileStore {
+public:
+    // Returns the 2 * nb bytes of the records, or NULL when they do not
+    // exist. The data must stay valid until the next call.
+    virtual const uint8_t *read(uint16_t file, uint16_t record, uint16_t nb) = 0;
+
+    // Returns false when the records do not exist or cannot be written
+    virtual bool write(uint16_t file, uint16_t record, uint16_t nb, const uint8_t *data) = 0;
+
+    // Whether write() would accept the records, checked for every
+    // sub-request before a write file record request changes anything
+    virtual bool writable(uint16_t file, uint16_t record, uint16_t nb) {
+        return read(file, record, nb) != NULL;
+    }
+};
+
+// Files stored back to back in a memory area, records_per_file records each,
+// the first one being file 1. The records are served in place.
+class ModbusMemoryFileStore : public ModbusFileStore {
+public:
+    ModbusMemoryFileStore(uint8_t *data, uint32_t size, uint16_t records_per_file = MODBUS_MAX_FILE_RECORDS);
+
+    // Read-only files, in flash for instance
+    ModbusMemoryFileStore(const uint8_t *data, uint32_t size, uint16_t records_per_file = MODBUS_MAX_FILE_RECORDS);
+
+    const uint8_t *read(uint16_t file, uint16_t record, uint16_t nb);
+    bool write(uint16_t file, uint16_t record, uint16_t nb, const uint8_t *data);
+    bool writable(uint16_t file, uint16_t record, uint16_t nb);
+
+protected:
+    uint8_t *locate(uint16_t file, uint16_t record, uint16_t nb);
+
+    uint8_t *_data;
+    uint32_t _size;
+    uint16_t _records_per_file;
+    bool _read_only;
+};
+
+#if defined(__linux__)
+// Files of a host file mapped in memory, see ModbusMemoryFileStore
+class ModbusMappedFileStore : public ModbusMemoryFileStore {
+public:
+    ModbusMappedFileStore(uint16_t records_per_file = MODBUS_MAX_FILE_RECORDS);
+    ~ModbusMappedFileStore();
+
+    bool open(const char *path, bool read_only = false);
+    void close(void);
+};
+#endif
+
+#endif /* MODBUS_FILE_h */
@@ -0,0 +1,288 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include <string.h>
+
+#include "crc16.h"
+#include "modbus_bits.h"
+#include "modbus_journal.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// A sector starts with its sequence number, little-endian, and a CRC,
+// written once its snapshot is complete. Records follow: address and number
+// of registers, little-endian, the registers as stored in memory then a CRC.
+// Erased bytes end the log.
+#define _SECTOR_HEADER_LENGTH  6
+#define _RECORD_HEADER_LENGTH  4
+#define _RECORD_MAX_REGISTERS  60
+#define _RECORD_LENGTH(nb)     (_RECORD_HEADER_LENGTH + 2 * (nb) + 2)
+
+ModbusJournalStorage::ModbusJournalStorage(uint32_t size, uint16_t sector_size) {
+	_size = size;
+	_sector_size = sector_size;
+}
+
+uint32_t ModbusJournalStorage::size(void) const {
+	return _size;
+}
+
+uint16_t ModbusJournalStorage::sectorSize(void) const {
+	return _sector_size;
+}
+
+ModbusJournal::ModbusJournal(ModbusJournalStorage *storage, uint16_t *tab_registers, uint16_t nb, uint8_t *tab_dirty) {
+	_storage = storage;
+	_tab_registers = tab_registers;
+	_nb = nb;
+	_tab_dirty = tab_dirty;
+
+	_nb_sectors = storage->size() / storage->sectorSize();
+	_sector = _nb_sectors - 1;
+	_sequence = 0;
+	_offset = 0;
+	_open = false;
+}
+
+// Whether the storage has two sectors, each holding the header, the
+// snapshot and a full record, so that a flush never has to open a sector
+// only to find it full
+bool ModbusJournal::fits(void) {
+	uint16_t records = (_nb + _RECORD_MAX_REGISTERS - 1) / _RECORD_MAX_REGISTERS;
+
+	return _nb_sectors >= 2 &&
+	       _SECTOR_HEADER_LENGTH + 2 * (uint32_t) _nb + records * _RECORD_LENGTH(0) +
+	       _RECORD_LENGTH(_RECORD_MAX_REGISTERS) <= _storage->sectorSize();
+}
+
+bool ModbusJournal::begin(void) {
+	uint16_t i, newest = _nb_sectors;
+	uint8_t header[_SECTOR_HEADER_LENGTH];
+	uint32_t sequence;
+
+	if (!fits()) return false;
+
+	// The newest committed sector holds the last snapshot. Erased sectors and
+	// headers cut by a power loss fail their CRC.
+	for (i = 0; i < _nb_sectors; i++) {
+		if (!_storage->read((uint32_t) i * _storage->sectorSize(), header, sizeof(header))) continue;
+		if (crc16(header, sizeof(header)) != 0) continue;
+
+		sequence = header[0] | ((uint32_t) header[1] << 8) | ((uint32_t) header[2] << 16) | ((uint32_t) header[3] << 24);
+		if (newest == _nb_sectors || sequence > _sequence) {
+			newest = i;
+			_sequence = sequence;
+		}
+	}
+	if (newest == _nb_sectors) return false;
+
+	// After a damaged record, the next flush starts a new sector
+	_sector = newest;
+	_open = replay(newest);
+	return true;
+}
+
+bool ModbusJournal::replay(uint16_t sector) {
+	uint8_t record[_RECORD_LENGTH(_RECORD_MAX_REGISTERS)];
+	uint32_t offset = (uint32_t) sector * _storage->sectorSize() + _SECTOR_HEADER_LENGTH;
+	uint32_t end = (uint32_t) (sector + 1) * _storage->sectorSize();
+	uint16_t address, nb;
+
+	while (offset + _RECORD_HEADER_LENGTH <= end) {
+		if (!_storage->read(offset, record, _RECORD_HEADER_LENGTH)) return false;
+
+		address = record[0] | (record[1] << 8);
+		nb      = record[2] | (record[3] << 8);
+		if (address == 0xFFFF && nb == 0xFFFF) break;
+
+		if (nb == 0 || nb > _RECORD_MAX_REGISTERS || (uint32_t) address + nb > _nb ||
+		    offset + _RECORD_LENGTH(nb) > end) {
+			return false;
+		}
+		if (!_storage->read(offset + _RECORD_HEADER_LENGTH, record + _RECORD_HEADER_LENGTH,
+		                    _RECORD_LENGTH(nb) - _RECORD_HEADER_LENGTH)) {
+			return false;
+		}
+		if (crc16(record, _RECORD_LENGTH(nb)) != 0) return false;
+
+		memcpy(_tab_registers + address, record + _RECORD_HEADER_LENGTH, 2 * nb);
+		offset += _RECORD_LENGTH(nb);
+	}
+
+	_offset = offset;
+	return true;
+}
+
+// Appends a record of the current values, false when the sector is full or
+// the storage fails
+bool ModbusJournal::append(uint16_t address, uint16_t nb) {
+	uint8_t record[_RECORD_LENGTH(_RECORD_MAX_REGISTERS)];
+
+	if (_offset + _RECORD_LENGTH(nb) > (uint32_t) (_sector + 1) * _storage->sectorSize()) return false;
+
+	record[0] = address & 0xFF;
+	record[1] = address >> 8;
+	record[2] = nb & 0xFF;
+	record[3] = nb >> 8;
+	memcpy(record + _RECORD_HEADER_LENGTH, _tab_registers + address, 2 * nb);
+	add_crc16(record, _RECORD_LENGTH(nb) - 2);
+
+	if (!_storage->write(_offset, record, _RECORD_LENGTH(nb))) return false;
+
+	_offset += _RECORD_LENGTH(nb);
+	return true;
+}
+
+// Erases the next sector and saves all the registers there
+bool ModbusJournal::open_sector(void) {
+	uint32_t start, sequence;
+	uint8_t header[_SECTOR_HEADER_LENGTH];
+	uint16_t address, nb;
+	bool ok;
+
+	if (!fits()) return false;
+
+	_open = false;
+	_sector = (_sector + 1) % _nb_sectors;
+	start = (uint32_t) _sector * _storage->sectorSize();
+	_offset = start + _SECTOR_HEADER_LENGTH;
+
+	// The registers changed from now on are flagged again for the next flush
+	memset(_tab_dirty, 0, (_nb + 7) >> 3);
+
+	ok = _storage->erase(start);
+	for (address = 0; ok && address < _nb; address += nb) {
+		nb = _nb - address < _RECORD_MAX_REGISTERS ? _nb - address : _RECORD_MAX_REGISTERS;
+		ok = append(address, nb);
+	}
+
+	// Committing the sector makes the previous one obsolete
+	sequence = _sequence + 1;
+	header[0] = sequence & 0xFF;
+	header[1] = (sequence >> 8) & 0xFF;
+	header[2] = (sequence >> 16) & 0xFF;
+	header[3] = sequence >> 24;
+	add_crc16(header, 4);
+	if (ok) ok = _storage->write(start, header, sizeof(header));
+
+	if (!ok) {
+		// Try again with the following sector at the next flush
+		modbus_set_bits(_tab_dirty, 0, _nb);
+		return false;
+	}
+
+	_sequence = sequence;
+	_open = true;
+	return true;
+}
+
+void ModbusJournal::changed(uint16_t address, uint16_t nb) {
+	if ((uint32_t) address + nb > _nb) return;
+	modbus_set_bits(_tab_dirty, address, nb);
+}
+
+bool ModbusJournal::flush(void) {
+	uint16_t address = 0, nb, n;
+
+	if (!_open) return open_sector();
+
+	while ((nb = modbus_take_bits(_tab_dirty, _nb, &address)) != 0) {
+		for (; nb; address += n, nb -= n) {
+			n = nb < _RECORD_MAX_REGISTERS ? nb : _RECORD_MAX_REGISTERS;
+
+			// A full sector is replaced by a new snapshot, which saves the
+			// rest of the changes as well
+			if (!append(address, n)) return open_sector();
+		}
+	}
+
+	return true;
+}
+
+#if defined(__linux__)
+ModbusFileJournalStorage::ModbusFileJournalStorage(uint32_t size, uint16_t sector_size)
+	: ModbusJournalStorage(size, sector_size) {
+	_fd = -1;
+	written = 0;
+	erased = 0;
+}
+
+ModbusFileJournalStorage::~ModbusFileJournalStorage() {
+	close();
+}
+
+// Opens or creates the file, a new file being erased
+bool ModbusFileJournalStorage::open(const char *path) {
+	off_t length;
+
+	close();
+
+	_fd = ::open(path, O_RDWR | O_CREAT, 0644);
+	if (_fd < 0) return false;
+
+	length = lseek(_fd, 0, SEEK_END);
+	for (uint32_t offset = length < 0 ? 0 : length; offset < _size; offset += _sector_size) {
+		if (!erase(offset - offset % _sector_size)) {
+			close();
+			return false;
+		}
+	}
+
+	erased = 0;
+	return true;
+}
+
+void ModbusFileJournalStorage::close(void) {
+	if (_fd >= 0) {
+		::close(_fd);
+		_fd = -1;
+	}
+}
+
+bool ModbusFileJournalStorage::read(uint32_t offset, void *data, uint16_t length) {
+	if (_fd < 0 || offset + length > _size) return false;
+	return pread(_fd, data, length, offset) == length;
+}
+
+bool ModbusFileJournalStorage::write(uint32_t offset, const void *data, uint16_t length) {
+	uint8_t bytes[256];
+	uint16_t i, n;
+
+	if (_fd < 0 || offset + length > _size) return false;
+
+	// Programming clears bits, it never sets them back
+	for (i = 0; i < length; i += n) {
+		n = length - i < (uint16_t) sizeof(bytes) ? length - i : (uint16_t) sizeof(bytes);
+		if (pread(_fd, bytes, n, offset + i) != n) return false;
+		for (uint16_t j = 0; j < n; j++) bytes[j] &= ((const uint8_t *) data)[i + j];
+		if (pwrite(_fd, bytes, n, offset + i) != n) return false;
+	}
+
+	written += length;
+	return true;
+}
+
+bool ModbusFileJournalStorage::erase(uint32_t offset) {
+	uint8_t bytes[256];
+	uint16_t i;
+
+	if (_fd < 0 || offset % _sector_size || offset + _sector_size > _size) return false;
+
+	memset(bytes, 0xFF, sizeof(bytes));
+	for (i = 0; i < _sector_size; i += sizeof(bytes)) {
+		uint16_t n = _sector_size - i < (uint16_t) sizeof(bytes) ? _sector_size - i : (uint16_t) sizeof(bytes);
+		if (pwrite(_fd, bytes, n, offset + i) != n) return false;
+	}
+
+	erased++;
+	return true;
+}
+#endif
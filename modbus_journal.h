@@ -0,0 +1,112 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_JOURNAL_h
+#define MODBUS_JOURNAL_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Flash, or EEPROM, holding a journal. It is made of sectors erased as a
+// whole to 0xFF, the bytes of an erased sector being written once.
+class ModbusJournalStorage {
+public:
+    ModbusJournalStorage(uint32_t size, uint16_t sector_size);
+
+    virtual bool read(uint32_t offset, void *data, uint16_t length) = 0;
+    virtual bool write(uint32_t offset, const void *data, uint16_t length) = 0;
+
+    // Erases the sector starting at offset
+    virtual bool erase(uint32_t offset) = 0;
+
+    uint32_t size(void) const;
+    uint16_t sectorSize(void) const;
+
+protected:
+    uint32_t _size;
+    uint16_t _sector_size;
+};
+
+// Registers kept across reboots. changed(), called from the on_write
+// callback of their segment, only flags the registers written by the masters
+// in tab_dirty; flush() appends the registers changed since the previous call
+// to a log. Several writes of a register between two flushes cost a single
+// record.
+//
+// tab_dirty belongs to the journal: it must not be the tab_dirty of a
+// segment, nor be drained with modbus_take_bits(), or the journal would miss
+// changes.
+//
+// The log fills the sectors one after the other, so they wear evenly. Each
+// sector starts with a snapshot of all the registers, so the previous one
+// can be erased in turn once the sector is committed, and a power loss
+// during a flush loses only the changes of that flush.
+//
+// A sector must hold the snapshot followed by at least one record of 60
+// registers, and the storage needs at least two sectors.
+class ModbusJournal {
+public:
+    ModbusJournal(ModbusJournalStorage *storage, uint16_t *tab_registers, uint16_t nb, uint8_t *tab_dirty);
+
+    // Restores the registers saved in the storage, returns false when there
+    // is none, or when the storage is too small for the journal, and the
+    // registers keep their values
+    bool begin(void);
+
+    // Flags nb registers from address, the first register of the journal
+    // being 0, to be saved by the next flush
+    void changed(uint16_t address, uint16_t nb);
+
+    // Saves the changed registers. Call it from the task running the slave,
+    // when the bus is idle for instance; the requests themselves never wait
+    // for the storage.
+    bool flush(void);
+
+private:
+    bool fits(void);
+    bool replay(uint16_t sector);
+    bool open_sector(void);
+    bool append(uint16_t address, uint16_t nb);
+
+    ModbusJournalStorage *_storage;
+    uint16_t *_tab_registers;
+    uint16_t _nb;
+    uint8_t *_tab_dirty;
+
+    uint16_t _nb_sectors;
+    uint16_t _sector;     // Sector being filled
+    uint32_t _sequence;   // Its sequence number, the newest sector has the highest
+    uint32_t _offset;     // Next record
+    bool _open;           // Records can be appended at _offset
+};
+
+#if defined(__linux__)
+// Storage in a host file, erased bytes are 0xFF and writes can only clear
+// bits, as on NOR flash. It also counts the bytes written and the sectors
+// erased, to measure the write amplification and the wear.
+class ModbusFileJournalStorage : public ModbusJournalStorage {
+public:
+    ModbusFileJournalStorage(uint32_t size, uint16_t sector_size);
+    ~ModbusFileJournalStorage();
+
+    bool open(const char *path);
+    void close(void);
+
+    bool read(uint32_t offset, void *data, uint16_t length);
+    bool write(uint32_t offset, const void *data, uint16_t length);
+    bool erase(uint32_t offset);
+
+    uint32_t written;
+    uint32_t erased;
+
+private:
+    int _fd;
+};
+#endif
+
+#endif /* MODBUS_JOURNAL_h */
@@ -0,0 +1,62 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include <string.h>
+
+#include "modbus_registers.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Both directions swap the bytes of every register, the arrays may overlap
+// exactly but need not be aligned
+static void swap_registers(const uint8_t *src, uint16_t nb, uint8_t *dest) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	// Native order is the wire order
+	memmove(dest, src, 2 * nb);
+#else
+	uint16_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 8 <= nb; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (dest + 2 * i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 <= nb; i += 8) {
+		vst1q_u8(dest + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+	}
+#elif !defined(__AVR__)
+	// Two registers per 32 bits word
+	for (; i + 2 <= nb; i += 2) {
+		uint32_t w;
+		memcpy(&w, src + 2 * i, 4);
+		w = ((w & 0x00FF00FF) << 8) | ((w >> 8) & 0x00FF00FF);
+		memcpy(dest + 2 * i, &w, 4);
+	}
+#endif
+
+	for (; i < nb; i++) {
+		uint8_t b = src[2 * i];
+		dest[2 * i]     = src[2 * i + 1];
+		dest[2 * i + 1] = b;
+	}
+#endif
+}
+
+void modbus_registers_to_wire(const uint16_t *src, uint16_t nb, uint8_t *dest) {
+	swap_registers((const uint8_t *) src, nb, dest);
+}
+
+void modbus_registers_from_wire(const uint8_t *src, uint16_t nb, uint16_t *dest) {
+	swap_registers(src, nb, (uint8_t *) dest);
+}
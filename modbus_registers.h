@@ -0,0 +1,36 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_REGISTERS_h
+#define MODBUS_REGISTERS_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Registers are sent big-endian. These kernels convert whole arrays, a SIMD
+// vector or a machine word at a time where the target allows it.
+
+// Stores nb registers of src in dest, most significant byte first.
+extern void modbus_registers_to_wire(const uint16_t *src, uint16_t nb, uint8_t *dest);
+
+// Loads nb registers received most significant byte first in src to dest.
+extern void modbus_registers_from_wire(const uint8_t *src, uint16_t nb, uint16_t *dest);
+
+// Register index of an array kept in the wire order, see MODBUS_ORDER_WIRE
+static inline uint16_t modbus_wire_get(const uint16_t *tab_registers, uint16_t index) {
+    const uint8_t *bytes = (const uint8_t *) (tab_registers + index);
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static inline void modbus_wire_set(uint16_t *tab_registers, uint16_t index, uint16_t value) {
+    uint8_t *bytes = (uint8_t *) (tab_registers + index);
+    bytes[0] = value >> 8;
+    bytes[1] = value & 0xFF;
+}
+
+#endif /* MODBUS_REGISTERS_h */
@@ -0,0 +1,106 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include "modbus_segment.h"
+
+// Index in memory of the byte of a native value of size bytes whose weight
+// is significance, 0 for the least significant byte
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define NATIVE_BYTE(size, significance) ((size) - 1 - (significance))
+#else
+#define NATIVE_BYTE(size, significance) (significance)
+#endif
+
+const modbus_segment_t *modbus_find_segments(const modbus_segment_t *segments, uint16_t nb_segments,
+                                             uint16_t address, uint16_t nb, uint8_t denied) {
+	uint16_t low = 0, high = nb_segments;
+	uint32_t end = (uint32_t) address + nb;
+	uint32_t segment_end;
+	const modbus_segment_t *first, *last;
+
+	// Last segment starting at or before address
+	while (low < high) {
+		uint16_t middle = (low + high) >> 1;
+		if (segments[middle].address <= address) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	if (low == 0) return NULL;
+
+	first = &segments[low - 1];
+	segment_end = (uint32_t) first->address + first->nb;
+	if (address >= segment_end || (first->access & denied)) return NULL;
+
+	// A range crossing the end of the segment goes on in the next ones, as
+	// long as they follow without a gap
+	last = segments + nb_segments;
+	for (const modbus_segment_t *s = first + 1; segment_end < end; s++) {
+		if (s == last || s->address != segment_end || (s->access & denied)) return NULL;
+		segment_end += s->nb;
+	}
+
+	return first;
+}
+
+// Value holding the register at offset, and the indexes in it of the high
+// and low bytes of the register. In the default order, the first register
+// of a value of nb registers is made of its bytes of weight 2 * nb - 1 and
+// 2 * nb - 2.
+static uint8_t *segment_bytes(const modbus_segment_t *segment, uint16_t offset, uint8_t *high, uint8_t *low) {
+	uint8_t nb = MODBUS_FORMAT_REGISTERS(segment->format);
+	uint8_t word = offset % nb;
+	uint8_t *value = (uint8_t *) segment->tab_registers + 2 * (offset - word);
+	uint8_t significance;
+
+	if (segment->order == MODBUS_ORDER_WIRE) {
+		*high = 0;
+		*low  = 1;
+		return (uint8_t *) (segment->tab_registers + offset);
+	}
+
+	if (segment->order & MODBUS_ORDER_CDAB) word = nb - 1 - word;
+	significance = 2 * (nb - 1 - word);
+
+	*high = NATIVE_BYTE(2 * nb, significance + 1);
+	*low  = NATIVE_BYTE(2 * nb, significance);
+	if (segment->order & MODBUS_ORDER_BADC) {
+		uint8_t swap = *high;
+		*high = *low;
+		*low  = swap;
+	}
+
+	return value;
+}
+
+uint16_t modbus_segment_get(const modbus_segment_t *segment, uint16_t offset) {
+	uint8_t high, low;
+	const uint8_t *value;
+
+	if (segment->format == MODBUS_FORMAT_UINT16 && segment->order == MODBUS_ORDER_ABCD) {
+		return segment->tab_registers[offset];
+	}
+
+	value = segment_bytes(segment, offset, &high, &low);
+	return (value[high] << 8) | value[low];
+}
+
+void modbus_segment_set(const modbus_segment_t *segment, uint16_t offset, uint16_t value) {
+	uint8_t high, low;
+	uint8_t *bytes;
+
+	if (segment->format == MODBUS_FORMAT_UINT16 && segment->order == MODBUS_ORDER_ABCD) {
+		segment->tab_registers[offset] = value;
+		return;
+	}
+
+	bytes = segment_bytes(segment, offset, &high, &low);
+	bytes[high] = value >> 8;
+	bytes[low]  = value & 0xFF;
+}
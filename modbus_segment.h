@@ -0,0 +1,93 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_SEGMENT_h
+#define MODBUS_SEGMENT_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Format of the values of a segment. The values are stored in the native
+// format of the CPU and converted when a request reads or writes them. The
+// low nibble of a format is the log2 of the number of registers of each
+// value, see MODBUS_FORMAT_REGISTERS().
+#define MODBUS_FORMAT_UINT16 0x00
+#define MODBUS_FORMAT_INT32  0x01
+#define MODBUS_FORMAT_UINT32 0x11
+#define MODBUS_FORMAT_FLOAT  0x21
+#define MODBUS_FORMAT_INT64  0x02
+#define MODBUS_FORMAT_DOUBLE 0x12
+
+#define MODBUS_FORMAT_REGISTERS(format) (1 << ((format) & 0x0F))
+
+// Order of the bytes of a value on the wire, most significant byte first by
+// default. Masters also use the registers swapped (CDAB), the bytes of each
+// register swapped (BADC), or both (DCBA).
+#define MODBUS_ORDER_ABCD 0
+#define MODBUS_ORDER_CDAB 1
+#define MODBUS_ORDER_BADC 2
+#define MODBUS_ORDER_DCBA 3
+
+// Plain registers already stored most significant byte first, as sent: the
+// requests copy them without conversion, the application uses
+// modbus_wire_get() and modbus_wire_set()
+#define MODBUS_ORDER_WIRE 4
+
+// Access of the masters to the registers of a segment
+#define MODBUS_ACCESS_READ_WRITE 0
+#define MODBUS_ACCESS_READ_ONLY  1
+#define MODBUS_ACCESS_WRITE_ONLY 2
+
+struct modbus_segment_t;
+
+// Called with the registers of a segment a request is about to read or has
+// just written, address being the first of them
+typedef void (*modbus_segment_callback_t)(const struct modbus_segment_t *segment, uint16_t address, uint16_t nb);
+
+// Range of registers backed by its own array, the register at address
+// is tab_registers[0]. The segments of a map are sorted by address and do not
+// overlap.
+//
+// Registers costly to keep up to date can be computed on demand: on_read
+// fills the requested slice of tab_registers just before it is sent, and
+// on_write is told about the registers a master changed.
+//
+// When tab_dirty is set, the registers written by a master are also flagged
+// there, one bit per register of the segment, see modbus_take_bits().
+//
+// A segment of 32 or 64 bits values points tab_registers at an array of
+// them, nb still counting registers.
+//
+// Several segments may point in the same array only to give its ranges
+// different access rights.
+typedef struct modbus_segment_t {
+    uint16_t address;
+    uint16_t nb;
+    uint16_t *tab_registers;
+    modbus_segment_callback_t on_read;
+    modbus_segment_callback_t on_write;
+    uint8_t *tab_dirty;
+    uint8_t format;
+    uint8_t order;
+    uint8_t access;
+} modbus_segment_t;
+
+// Returns the segment holding the register at address, followed by the
+// adjacent segments holding the next nb - 1 registers, or NULL when one of
+// the registers is not mapped or belongs to a segment whose access is one
+// of the denied ones. The segments are found by a binary search.
+extern const modbus_segment_t *modbus_find_segments(const modbus_segment_t *segments, uint16_t nb_segments,
+                                                    uint16_t address, uint16_t nb, uint8_t denied);
+
+// Register at offset from the start of a segment, as sent on the wire, and
+// its update. Segments of plain registers in the default order simply use
+// tab_registers[offset].
+extern uint16_t modbus_segment_get(const modbus_segment_t *segment, uint16_t offset);
+extern void modbus_segment_set(const modbus_segment_t *segment, uint16_t offset, uint16_t value);
+
+#endif /* MODBUS_SEGMENT_h */
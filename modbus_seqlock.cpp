@@ -0,0 +1,77 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#include "modbus_seqlock.h"
+
+#if defined(__AVR__)
+#include <util/atomic.h>
+#endif
+
+ModbusSeqlock::ModbusSeqlock() {
+	_sequence = 0;
+}
+
+#if defined(__AVR__)
+// Readers and writers only race with interrupt handlers, which the atomic
+// blocks keep out. They also act as compiler barriers.
+void ModbusSeqlock::writeBegin(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_sequence++;
+	}
+}
+
+void ModbusSeqlock::writeEnd(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_sequence++;
+	}
+}
+
+uint32_t ModbusSeqlock::readBegin(void) const {
+	uint8_t sequence;
+
+	while ((sequence = _sequence) & 1);
+	__asm__ __volatile__ ("" ::: "memory");
+	return sequence;
+}
+
+bool ModbusSeqlock::readRetry(uint32_t sequence) const {
+	__asm__ __volatile__ ("" ::: "memory");
+	return _sequence != sequence;
+}
+#else
+void ModbusSeqlock::writeBegin(void) {
+	uint32_t sequence;
+
+	// Take the lock by making the sequence odd
+	do {
+		sequence = __atomic_load_n(&_sequence, __ATOMIC_RELAXED) & ~1UL;
+	} while (!__atomic_compare_exchange_n(&_sequence, &sequence, sequence + 1, true,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	// The registers must not be updated before readers can see the odd value
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ModbusSeqlock::writeEnd(void) {
+	__atomic_store_n(&_sequence, __atomic_load_n(&_sequence, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t ModbusSeqlock::readBegin(void) const {
+	uint32_t sequence;
+
+	// Wait for the writer to be done
+	while ((sequence = __atomic_load_n(&_sequence, __ATOMIC_ACQUIRE)) & 1);
+	return sequence;
+}
+
+bool ModbusSeqlock::readRetry(uint32_t sequence) const {
+	// The copy must be complete before the sequence is read again
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&_sequence, __ATOMIC_RELAXED) != sequence;
+}
+#endif
@@ -0,0 +1,46 @@
+/*
+ * License ISC, see LICENSE for more details.
+ *
+ * This library implements the Modbus protocol.
+ * http://libmodbus.org/
+ *
+ */
+
+#ifndef MODBUS_SEQLOCK_h
+#define MODBUS_SEQLOCK_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sequence lock guarding the holding registers of a mapping, so that values
+// spread over several registers are read whole while another core updates
+// them. Readers never block writers: they copy the registers and start again
+// when a write went on meanwhile.
+//
+// Writers wait for each other, so an interrupt handler must not write while
+// the code it interrupted holds the lock.
+class ModbusSeqlock {
+public:
+    ModbusSeqlock();
+
+    // Writer side, around the updates of the registers
+    void writeBegin(void);
+    void writeEnd(void);
+
+    // Reader side: copy the registers after readBegin(), the copy is
+    // consistent unless readRetry() returns true
+    uint32_t readBegin(void) const;
+    bool readRetry(uint32_t sequence) const;
+
+private:
+    // Odd while a writer is updating the registers. AVR has no atomic
+    // read-modify-write of 32 bits: a byte, updated with the interrupts
+    // disabled, is enough on its single core.
+#if defined(__AVR__)
+    volatile uint8_t _sequence;
+#else
+    uint32_t _sequence;
+#endif
+};
+
+#endif /* MODBUS_SEQLOCK_h */
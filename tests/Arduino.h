@@ -0,0 +1,54 @@
+/*
+ * Host stand-in for the parts of the Arduino core used by the library, so
+ * that the tests can drive the slave through simulated serial ports.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_byte(x) (*((const uint8_t*)(x)))
+#define pgm_read_ptr(x) (*((void * const *)(x)))
+#define strlen_P strlen
+
+#define OUTPUT 1
+
+class HardwareSerial {
+public:
+	void begin(long baud) { (void)baud; }
+	int available() { return rx_tail - rx_head; }
+	int read() { return rx_head < rx_tail ? rx[rx_head++] : -1; }
+	size_t write(uint8_t c) { if (tx_length < sizeof(tx)) tx[tx_length++] = c; return 1; }
+	size_t write(const uint8_t *data, size_t length) { for (size_t i = 0; i < length; i++) write(data[i]); return length; }
+	void flush() {}
+
+	// Test side: bytes sent by the master, bytes answered by the slave
+	void feed(const uint8_t *data, size_t length) {
+		if (rx_head == rx_tail) rx_head = rx_tail = 0;
+		memcpy(rx + rx_tail, data, length);
+		rx_tail += length;
+	}
+	void clear() { rx_head = rx_tail = 0; tx_length = 0; }
+
+	uint8_t rx[1 << 20];
+	size_t  rx_head = 0;
+	size_t  rx_tail = 0;
+	uint8_t tx[1 << 16];
+	size_t  tx_length = 0;
+};
+
+static HardwareSerial Serial2;
+
+static inline void pinMode(int pin, int mode) { (void)pin; (void)mode; }
+static inline void digitalWrite(int pin, int value) { (void)pin; (void)value; }
+
+// Simulated clock, only advanced by delay()
+static unsigned long _millis;
+static inline unsigned long millis() { return __atomic_load_n(&_millis, __ATOMIC_RELAXED); }
+static inline void delay(unsigned long ms) { __atomic_fetch_add(&_millis, ms, __ATOMIC_RELAXED); }
+
+#endif /* Arduino_h */
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <chrono>
+
+#include "../modbus_bits.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define NB_COILS  2000
+#define RUNS      100000
+
+static uint8_t tab_bits[1024];
+static uint8_t dest[NB_COILS / 8 + 1];
+static uint8_t expected[NB_COILS / 8 + 1];
+
+// The per bit loop the kernels replace
+static void read_bits_per_bit(const uint8_t *tab, uint16_t address, uint16_t nb, uint8_t *out) {
+	memset(out, 0, (nb + 7) >> 3);
+	for (uint16_t i = 0; i < nb; i++) {
+		if (tab[(address + i) >> 3] & (1 << ((address + i) & 7))) {
+			out[i >> 3] |= 1 << (i & 7);
+		}
+	}
+}
+
+static void write_bits_per_bit(uint8_t *tab, uint16_t address, uint16_t nb, const uint8_t *in) {
+	for (uint16_t i = 0; i < nb; i++) {
+		uint16_t bit = address + i;
+		if (in[i >> 3] & (1 << (i & 7))) {
+			tab[bit >> 3] |= 1 << (bit & 7);
+		} else {
+			tab[bit >> 3] &= ~(1 << (bit & 7));
+		}
+	}
+}
+
+static bool test_kernels(void) {
+	static uint8_t tab_a[sizeof(tab_bits)], tab_b[sizeof(tab_bits)];
+	uint8_t src[256];
+
+	for (int n = 0; n < 100000; n++) {
+		uint16_t nb = 1 + rand() % NB_COILS;
+		uint16_t address = rand() % (8 * sizeof(tab_bits) - nb);
+
+		read_bits_per_bit(tab_bits, address, nb, expected);
+		modbus_read_bits(tab_bits, address, nb, dest);
+		if (memcmp(dest, expected, (nb + 7) >> 3)) return false;
+
+		for (size_t i = 0; i < sizeof(src); i++) src[i] = rand();
+		memcpy(tab_a, tab_bits, sizeof(tab_bits));
+		memcpy(tab_b, tab_bits, sizeof(tab_bits));
+		write_bits_per_bit(tab_a, address, nb, src);
+		modbus_write_bits(tab_b, address, nb, src);
+		if (memcmp(tab_a, tab_b, sizeof(tab_a))) return false;
+	}
+
+	return true;
+}
+
+// Ranges set then taken back must come out merged, in order and cleared
+static bool test_dirty(void) {
+	static uint8_t dirty[128];
+	static bool expected[8 * sizeof(dirty)];
+	const uint16_t nb_bits = 8 * sizeof(dirty) - 3;
+
+	for (int n = 0; n < 10000; n++) {
+		for (int k = rand() % 8; k > 0; k--) {
+			uint16_t address = rand() % nb_bits;
+			uint16_t nb = 1 + rand() % (nb_bits - address);
+			if (rand() & 1) nb = 1 + (nb - 1) % 20;
+			modbus_set_bits(dirty, address, nb);
+			for (uint16_t i = address; i < address + nb; i++) expected[i] = true;
+		}
+
+		uint16_t address = 0, nb;
+		uint16_t last_end = 0;
+		while ((nb = modbus_take_bits(dirty, nb_bits, &address)) != 0) {
+			if (address < last_end || (address == last_end && address != 0)) return false;
+			for (uint16_t i = last_end; i < address; i++) if (expected[i]) return false;
+			for (uint16_t i = address; i < address + nb; i++) {
+				if (!expected[i]) return false;
+				expected[i] = false;
+			}
+			address += nb;
+			last_end = address;
+		}
+		for (uint16_t i = last_end; i < nb_bits; i++) if (expected[i]) return false;
+		for (size_t i = 0; i < sizeof(dirty); i++) if (dirty[i]) return false;
+	}
+
+	return true;
+}
+
+template <typename F>
+static double bench(F read) {
+	uint16_t addresses[64];
+	for (size_t i = 0; i < SIZE(addresses); i++) addresses[i] = rand() % (8 * sizeof(tab_bits) - NB_COILS);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < RUNS; n++) {
+		read(tab_bits, addresses[n % SIZE(addresses)], NB_COILS, dest);
+		__asm__ __volatile__("" : : "r"(dest) : "memory");
+	}
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / RUNS;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	for (size_t i = 0; i < sizeof(tab_bits); i++) tab_bits[i] = rand();
+
+	bool ok = test_kernels();
+	ok &= test_dirty();
+
+	printf("Read %d coils, per bit loop: %8.1f ns\n", NB_COILS, bench(read_bits_per_bit));
+	printf("Read %d coils, word kernel:  %8.1f ns\n", NB_COILS, bench(modbus_read_bits));
+
+	if (ok) {
+		puts("Bits Ok!");
+		return 0;
+	} else {
+		puts("Bits Fail!");
+		return 1;
+	}
+}
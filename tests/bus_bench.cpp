@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <chrono>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define NODES            30
+#define OFFLINE_NODES    3     // The last nodes never answer
+#define ROUNDS           20000
+#define TURNAROUND       5     // Milliseconds before an answer or the next request
+#define RESPONSE_TIMEOUT 500   // Milliseconds the master waits for an answer
+#define RETRIES          2
+
+static uint8_t frame[_MODBUSINO_RTU_MAX_ADU_LENGTH];
+
+static void feed(uint8_t length) {
+	add_crc16(frame, length);
+	Serial2.feed(frame, length + 2);
+}
+
+// Sends a request, returns the length of the response
+static size_t transact(SimpleModbusSlave &slave, const uint8_t *request, uint8_t length) {
+	memcpy(frame, request, length);
+	Serial2.clear();
+	feed(length);
+	slave.loop();
+	return Serial2.tx_length;
+}
+
+// The response is the exception code of the request function
+static bool exception(uint8_t code) {
+	return Serial2.tx_length == 5 && (Serial2.tx[1] & 0x80) && Serial2.tx[2] == code && crc16(Serial2.tx, 5) == 0;
+}
+
+// Request of the master, a write when kind is below 3
+static void request(uint8_t slave, uint8_t kind, uint8_t nb) {
+	frame[0] = slave;
+	frame[2] = 0; frame[3] = 0;
+	frame[4] = 0; frame[5] = nb;
+	if (kind < 3) {
+		frame[1] = _FC_WRITE_MULTIPLE_REGISTERS;
+		frame[6] = nb * 2;
+		for (int i = 0; i < nb * 2; i++) frame[7 + i] = rand();
+		feed(7 + nb * 2);
+	} else {
+		frame[1] = _FC_READ_HOLDING_REGISTERS;
+		feed(6);
+	}
+}
+
+// Answer of another slave to the request in frame, an exception when kind
+// is 7
+static void answer(uint8_t kind, uint8_t nb) {
+	if (kind == 7) {
+		frame[1] |= 0x80;
+		frame[2] = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		feed(3);
+	} else if (frame[1] == _FC_WRITE_MULTIPLE_REGISTERS) {
+		feed(6);
+	} else {
+		frame[2] = nb * 2;
+		for (int i = 0; i < nb * 2; i++) frame[3 + i] = rand();
+		feed(3 + nb * 2);
+	}
+}
+
+// Master polling NODES slaves, slave 1 being us, in real time: the requests
+// to offline nodes are repeated after the response timeout of the master.
+// Every request for us must be answered.
+static bool test_sync(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs[16];
+	int own = 0, answered = 0, errors = 0, retries = 0;
+
+	Serial2.clear();
+	slave.setup(115200, 0);
+	srand(1);
+	for (int round = 0; round < ROUNDS; round++) {
+		uint8_t node = 1 + rand() % NODES;
+		uint8_t nb   = 1 + rand() % 16;
+		uint8_t kind = rand() % 8;
+
+		if (kind == 0) {
+			// Broadcast write, nobody answers
+			node = MODBUS_BROADCAST_ADDRESS;
+		}
+
+		for (int attempt = 0; attempt <= RETRIES; attempt++) {
+			request(node, kind, nb);
+			if (node == 1 || node == MODBUS_BROADCAST_ADDRESS) own++;
+
+			while (Serial2.available()) {
+				int rc = slave.loop(regs, SIZE(regs));
+				if (rc > 0) {
+					answered++;
+				} else if (rc != -1 - MODBUS_INFORMATIVE_NOT_FOR_US) {
+					errors++;
+				}
+			}
+			delay(TURNAROUND);
+
+			if (node == 1 || node == MODBUS_BROADCAST_ADDRESS) break;
+			if (node <= NODES - OFFLINE_NODES) {
+				answer(kind, nb);
+				while (Serial2.available()) {
+					if (slave.loop(regs, SIZE(regs)) != -1 - MODBUS_INFORMATIVE_NOT_FOR_US) errors++;
+				}
+				delay(TURNAROUND);
+				break;
+			}
+
+			// No answer, the master tries again
+			delay(RESPONSE_TIMEOUT - TURNAROUND);
+			retries++;
+		}
+	}
+
+	printf("Frames for us:     %d / %d\n", answered, own);
+	printf("Offline retries:   %d\n", retries);
+	printf("Errors:            %d\n", errors);
+	return answered == own && errors == 0;
+}
+
+// A byte count beyond the receive buffer is an overrun, answered by an
+// exception
+static bool test_overrun(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs[16];
+	bool ok = true;
+
+	for (int count = 0xFE; count <= 0xFF; count++) {
+		Serial2.clear();
+		frame[0] = 1;
+		frame[1] = _FC_WRITE_MULTIPLE_REGISTERS;
+		frame[2] = 0; frame[3] = 0;
+		frame[4] = 0; frame[5] = count / 2;
+		frame[6] = count;
+		Serial2.feed(frame, 7);
+
+		ok &= slave.loop(regs, SIZE(regs)) == -1 - MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		ok &= Serial2.tx_length == 5 && Serial2.tx[1] == (_FC_WRITE_MULTIPLE_REGISTERS | 0x80) &&
+		      Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	ok &= slave.counters()->overruns == 2 && slave.counters()->bus_errors == 0;
+	return ok;
+}
+
+// Coils and discrete inputs through the slave: byte counts, padding of the
+// last byte, single coil values and exceptions
+static bool test_bits(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	uint8_t coils[3] = {0, 0x40, 0};        // Coil 14 on
+	uint8_t inputs[2] = {0x5A, 0xFF};
+	bool ok = true;
+
+	mapping.nb_bits        = 20;
+	mapping.tab_bits       = coils;
+	mapping.nb_input_bits  = 10;
+	mapping.tab_input_bits = inputs;
+	slave.addSlave(1, &mapping);
+
+	// Coils 3 to 13, coil 14 left alone
+	const uint8_t write[] = {1, _FC_WRITE_MULTIPLE_COILS, 0, 3, 0, 11, 2, 0xAB, 0x05};
+	ok &= transact(slave, write, sizeof(write)) == 8 && memcmp(Serial2.tx, write, 6) == 0;
+	ok &= coils[0] == (0xAB << 3 & 0xFF) && coils[1] == (0x40 | 0xAB >> 5 | 0x05 << 3);
+
+	const uint8_t read[] = {1, _FC_READ_COILS, 0, 3, 0, 11};
+	ok &= transact(slave, read, sizeof(read)) == 7 && Serial2.tx[2] == 2;
+	ok &= Serial2.tx[3] == 0xAB && Serial2.tx[4] == 0x05 && crc16(Serial2.tx, 7) == 0;
+
+	const uint8_t read_inputs[] = {1, _FC_READ_DISCRETE_INPUTS, 0, 0, 0, 10};
+	ok &= transact(slave, read_inputs, sizeof(read_inputs)) == 7 && Serial2.tx[2] == 2;
+	ok &= Serial2.tx[3] == 0x5A && Serial2.tx[4] == 0x03;
+
+	const uint8_t on[] = {1, _FC_WRITE_SINGLE_COIL, 0, 19, 0xFF, 0x00};
+	const uint8_t off[] = {1, _FC_WRITE_SINGLE_COIL, 0, 14, 0x00, 0x00};
+	ok &= transact(slave, on, sizeof(on)) == 8 && memcmp(Serial2.tx, on, 6) == 0 && coils[2] == 0x08;
+	ok &= transact(slave, off, sizeof(off)) == 8 && !(coils[1] & 0x40);
+
+	const uint8_t bad_value[] = {1, _FC_WRITE_SINGLE_COIL, 0, 0, 0x12, 0x34};
+	const uint8_t bad_coil[] = {1, _FC_WRITE_SINGLE_COIL, 0, 20, 0xFF, 0x00};
+	const uint8_t no_bits[] = {1, _FC_READ_COILS, 0, 0, 0, 0};
+	const uint8_t beyond[] = {1, _FC_READ_DISCRETE_INPUTS, 0, 5, 0, 6};
+	const uint8_t bad_count[] = {1, _FC_WRITE_MULTIPLE_COILS, 0, 0, 0, 9, 1, 0xFF};
+	const uint8_t bad_range[] = {1, _FC_WRITE_MULTIPLE_COILS, 0, 15, 0, 6, 1, 0x3F};
+	transact(slave, bad_value, sizeof(bad_value));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) && coils[0] == (0xAB << 3 & 0xFF);
+	transact(slave, bad_coil, sizeof(bad_coil));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	transact(slave, no_bits, sizeof(no_bits));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+	transact(slave, beyond, sizeof(beyond));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	transact(slave, bad_count, sizeof(bad_count));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+	transact(slave, bad_range, sizeof(bad_range));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS) && coils[2] == 0x08;
+
+	return ok;
+}
+
+// Read/write multiple registers: the write is applied before the read, the
+// byte count must match the write quantity
+static bool test_write_and_read(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	uint16_t regs[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+	bool ok = true;
+
+	mapping.nb_registers  = SIZE(regs);
+	mapping.tab_registers = regs;
+	slave.addSlave(1, &mapping);
+
+	// Writes 2 registers at 3, reads 4 from 2
+	const uint8_t request[] = {1, _FC_WRITE_AND_READ_REGISTERS, 0, 2, 0, 4, 0, 3, 0, 2, 4, 0x12, 0x34, 0x56, 0x78};
+	const uint8_t response[] = {1, _FC_WRITE_AND_READ_REGISTERS, 8, 0, 2, 0x12, 0x34, 0x56, 0x78, 0, 5};
+	ok &= transact(slave, request, sizeof(request)) == sizeof(response) + 2;
+	ok &= memcmp(Serial2.tx, response, sizeof(response)) == 0 && crc16(Serial2.tx, sizeof(response) + 2) == 0;
+	ok &= regs[3] == 0x1234 && regs[4] == 0x5678;
+
+	// 2 registers to write but 6 bytes of values
+	const uint8_t bad_count[] = {1, _FC_WRITE_AND_READ_REGISTERS, 0, 0, 0, 1, 0, 0, 0, 2, 6, 0, 9, 0, 9, 0, 9};
+	transact(slave, bad_count, sizeof(bad_count));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) && regs[0] == 0 && regs[1] == 1;
+
+	// The write is out of range, nothing is written
+	const uint8_t beyond[] = {1, _FC_WRITE_AND_READ_REGISTERS, 0, 0, 0, 1, 0, 7, 0, 2, 4, 0, 9, 0, 9};
+	transact(slave, beyond, sizeof(beyond));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS) && regs[7] == 7;
+
+	return ok;
+}
+
+// Read FIFO queue (0x18): empty queue, too many values, draining
+static bool test_fifo(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	uint16_t samples[64];
+	ModbusFifo fifo(samples, SIZE(samples));
+	ModbusFifo *fifos[] = {&fifo};
+	const uint8_t request[] = {1, _FC_READ_FIFO_QUEUE, 0, 0};
+	const uint8_t beyond[] = {1, _FC_READ_FIFO_QUEUE, 0, 1};
+	bool ok = true;
+	int i;
+
+	mapping.nb_fifos  = SIZE(fifos);
+	mapping.tab_fifos = fifos;
+	slave.addSlave(1, &mapping);
+
+	// Byte count and FIFO count only
+	const uint8_t empty[] = {1, _FC_READ_FIFO_QUEUE, 0, 2, 0, 0};
+	ok &= transact(slave, request, sizeof(request)) == 8 && memcmp(Serial2.tx, empty, 6) == 0;
+	ok &= crc16(Serial2.tx, 8) == 0;
+
+	// 32 values are too many, none is removed
+	for (i = 0; i < 32; i++) fifo.push(0x100 + i);
+	transact(slave, request, sizeof(request));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) && fifo.count() == 32;
+
+	// 31 values are drained at once, the oldest first
+	fifo.consume(1);
+	ok &= transact(slave, request, sizeof(request)) == 8 + 31 * 2 && crc16(Serial2.tx, 8 + 31 * 2) == 0;
+	ok &= Serial2.tx[2] == 0 && Serial2.tx[3] == 2 + 31 * 2 && Serial2.tx[4] == 0 && Serial2.tx[5] == 31;
+	for (i = 0; i < 31; i++) ok &= Serial2.tx[6 + 2 * i] == 1 && Serial2.tx[7 + 2 * i] == 1 + i;
+	ok &= fifo.count() == 0;
+	ok &= transact(slave, request, sizeof(request)) == 8 && memcmp(Serial2.tx, empty, 6) == 0;
+
+	transact(slave, beyond, sizeof(beyond));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	return ok;
+}
+
+static const char vendor_name[] PROGMEM = "ACME";
+static const char product_code[] PROGMEM = "AC-100";
+static const char revision[] PROGMEM = "1.0";
+static char notes[201];
+static char manual[301];
+
+static const modbus_device_id_t device_id[] PROGMEM = {
+	{MODBUS_DEVICE_ID_VENDOR_NAME, vendor_name},
+	{MODBUS_DEVICE_ID_PRODUCT_CODE, product_code},
+	{MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION, revision},
+	{0x80, notes},
+	{0x81, manual},
+};
+
+// Read device identification request, returns the length of the response
+static size_t identification(SimpleModbusSlave &slave, uint8_t code, uint8_t object_id) {
+	const uint8_t request[] = {1, _FC_ENCAPSULATED_INTERFACE, _MEI_READ_DEVICE_ID, code, object_id};
+
+	return transact(slave, request, sizeof(request));
+}
+
+// Header of a device identification response
+static bool objects(uint8_t code, uint8_t conformity, uint8_t more, uint8_t next, uint8_t nb) {
+	uint8_t *rsp = Serial2.tx;
+
+	return Serial2.tx_length >= 10 && crc16(rsp, Serial2.tx_length) == 0 && rsp[1] == _FC_ENCAPSULATED_INTERFACE &&
+	       rsp[2] == _MEI_READ_DEVICE_ID && rsp[3] == code && rsp[4] == conformity && rsp[5] == more &&
+	       rsp[6] == next && rsp[7] == nb;
+}
+
+// Read device identification (0x2B / 0x0E): conformity level, stream access
+// paged over several responses, individual access
+static bool test_device_identification(void) {
+	SimpleModbusSlave slave(1);
+	bool ok = true;
+
+	memset(notes, 'n', sizeof(notes) - 1);
+	memset(manual, 'm', sizeof(manual) - 1);
+
+	// Only the basic objects
+	slave.setDeviceIdentification(device_id, 3);
+	identification(slave, 0x01, 0);
+	ok &= objects(0x01, 0x81, 0, 0, 3) && Serial2.tx_length == 8 + 6 + 4 + 6 + 3 + 2;
+	ok &= Serial2.tx[8] == 0 && Serial2.tx[9] == 4 && memcmp(Serial2.tx + 10, "ACME", 4) == 0;
+	ok &= Serial2.tx[14] == 1 && Serial2.tx[15] == 6 && memcmp(Serial2.tx + 16, "AC-100", 6) == 0;
+
+	slave.setDeviceIdentification(device_id, SIZE(device_id));
+
+	// An object outside the category restarts at the beginning
+	identification(slave, 0x01, 0x80);
+	ok &= objects(0x01, 0x83, 0, 0, 3) && Serial2.tx[8] == 0;
+	identification(slave, 0x02, 0x81);
+	ok &= objects(0x02, 0x83, 0, 0, 3) && Serial2.tx[8] == 0;
+
+	// The objects do not fit in one response, the one longer than a
+	// response is truncated
+	identification(slave, 0x03, 0);
+	ok &= objects(0x03, 0x83, 0xFF, 0x81, 4);
+	ok &= Serial2.tx_length == 10 + 6 + 8 + 5 + 202;
+	identification(slave, 0x03, 0x81);
+	ok &= objects(0x03, 0x83, 0, 0, 1) && Serial2.tx[8] == 0x81 && Serial2.tx[9] == MODBUS_MAX_PDU_LENGTH - 9;
+	ok &= Serial2.tx_length == 10 + 2 + MODBUS_MAX_PDU_LENGTH - 9 && Serial2.tx[10 + MODBUS_MAX_PDU_LENGTH - 10] == 'm';
+
+	identification(slave, 0x04, MODBUS_DEVICE_ID_PRODUCT_CODE);
+	ok &= objects(0x04, 0x83, 0, 0, 1) && Serial2.tx[8] == 1 && Serial2.tx[9] == 6;
+	ok &= memcmp(Serial2.tx + 10, "AC-100", 6) == 0;
+
+	identification(slave, 0x04, MODBUS_DEVICE_ID_VENDOR_URL);
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	identification(slave, 0x05, 0);
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+	return ok;
+}
+
+// Exceptions are counted once sent, never for broadcasts
+static bool test_counters(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs1[16], regs2[16];
+	modbus_mapping_t map1 = {}, map2 = {};
+	const uint8_t broadcast[] = {MODBUS_BROADCAST_ADDRESS, _FC_WRITE_SINGLE_REGISTER, 0, 100, 0, 1};
+	const uint8_t read[] = {1, _FC_READ_HOLDING_REGISTERS, 0, 100, 0, 1};
+	const uint8_t events[] = {1, _FC_GET_COMM_EVENT_COUNTER};
+	bool ok = true;
+
+	map1.nb_registers  = SIZE(regs1);
+	map1.tab_registers = regs1;
+	map2.nb_registers  = SIZE(regs2);
+	map2.tab_registers = regs2;
+	slave.addSlave(1, &map1);
+	slave.addSlave(2, &map2);
+
+	// Beyond the registers of both addresses
+	Serial2.clear();
+	memcpy(frame, broadcast, sizeof(broadcast));
+	feed(sizeof(broadcast));
+	slave.loop();
+	ok &= Serial2.tx_length == 0 && slave.counters()->exceptions == 0;
+
+	Serial2.clear();
+	memcpy(frame, read, sizeof(read));
+	feed(sizeof(read));
+	slave.loop();
+	ok &= Serial2.tx_length == 5 && slave.counters()->exceptions == 1;
+
+	// The broadcast failed as well, so there is no event yet
+	Serial2.clear();
+	memcpy(frame, events, sizeof(events));
+	feed(sizeof(events));
+	slave.loop();
+	ok &= Serial2.tx_length == 8 && Serial2.tx[4] == 0 && Serial2.tx[5] == 0;
+
+	// A broadcast applied by both addresses is one event, the fetches do
+	// not count
+	memcpy(frame, broadcast, sizeof(broadcast));
+	frame[3] = 15;
+	feed(sizeof(broadcast));
+	slave.loop();
+	ok &= regs1[15] == 1 && regs2[15] == 1;
+	transact(slave, events, sizeof(events));
+	ok &= Serial2.tx_length == 8 && Serial2.tx[4] == 0 && Serial2.tx[5] == 1 && slave.counters()->events == 1;
+	return ok;
+}
+
+// Value of a diagnostics counter, -1 when the request fails
+static int diagnostic(SimpleModbusSlave &slave, uint8_t sub_function) {
+	const uint8_t request[] = {1, _FC_DIAGNOSTICS, 0, sub_function, 0, 0};
+
+	if (transact(slave, request, sizeof(request)) != 8 || memcmp(Serial2.tx, request, 4) != 0) return -1;
+	return (Serial2.tx[4] << 8) + Serial2.tx[5];
+}
+
+// Diagnostics (0x08): echo of the query data, every counter, clear
+static bool test_diagnostics(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs[4] = {};
+	modbus_mapping_t mapping = {};
+	const uint8_t echo[] = {1, _FC_DIAGNOSTICS, 0, 0, 0x12, 0x34};
+	const uint8_t read[] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, 4};
+	const uint8_t beyond[] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, 5};
+	const uint8_t broadcast[] = {MODBUS_BROADCAST_ADDRESS, _FC_WRITE_SINGLE_REGISTER, 0, 0, 0, 1};
+	const uint8_t other[] = {2, _FC_WRITE_SINGLE_REGISTER, 0, 0, 0, 1};
+	const uint8_t clear[] = {1, _FC_DIAGNOSTICS, 0, 0x0A, 0, 0};
+	const uint8_t unknown[] = {1, _FC_DIAGNOSTICS, 0, 0x13, 0, 0};
+	const uint8_t data[] = {1, _FC_DIAGNOSTICS, 0, 0x0B, 0, 1};
+	bool ok = true;
+
+	mapping.nb_registers  = SIZE(regs);
+	mapping.tab_registers = regs;
+	slave.addSlave(1, &mapping);
+
+	ok &= transact(slave, echo, sizeof(echo)) == 8 && memcmp(Serial2.tx, echo, 6) == 0 && crc16(Serial2.tx, 8) == 0;
+	transact(slave, read, sizeof(read));
+	transact(slave, beyond, sizeof(beyond));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	transact(slave, broadcast, sizeof(broadcast));
+	ok &= Serial2.tx_length == 0 && regs[0] == 1;
+
+	// The request to another slave and its echo
+	Serial2.clear();
+	memcpy(frame, other, sizeof(other));
+	feed(sizeof(other));
+	feed(sizeof(other));
+	slave.loop();
+	slave.loop();
+	ok &= Serial2.tx_length == 0;
+
+	// A frame with a bad CRC
+	Serial2.clear();
+	memcpy(frame, read, sizeof(read));
+	add_crc16(frame, sizeof(read));
+	frame[sizeof(read)] ^= 1;
+	Serial2.feed(frame, sizeof(read) + 2);
+	slave.loop();
+	ok &= Serial2.tx_length == 0;
+
+	// The counters include the requests reading them
+	ok &= diagnostic(slave, 0x0B) == 8;     // Bus messages
+	ok &= diagnostic(slave, 0x0C) == 1;     // Bus communication errors
+	ok &= diagnostic(slave, 0x0D) == 1;     // Slave exceptions
+	ok &= diagnostic(slave, 0x0E) == 8;     // Slave messages
+	ok &= diagnostic(slave, 0x0F) == 1;     // Slave no responses
+	ok &= diagnostic(slave, 0x12) == 0;     // Character overruns
+	ok &= slave.counters()->events == 9;
+
+	transact(slave, unknown, sizeof(unknown));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	transact(slave, data, sizeof(data));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+	ok &= transact(slave, clear, sizeof(clear)) == 8 && memcmp(Serial2.tx, clear, 6) == 0;
+	ok &= slave.counters()->events == 0 && slave.counters()->exceptions == 0;
+	ok &= diagnostic(slave, 0x0B) == 1 && diagnostic(slave, 0x0E) == 2 && diagnostic(slave, 0x0D) == 0;
+	return ok;
+}
+
+// Request: function, byte count, data. Response: byte count, sum of the
+// data on 16 bits.
+static int sum(modbus_mapping_t *mapping, const uint8_t *req, uint8_t req_length, uint8_t *rsp) {
+	uint16_t total = 0;
+
+	UNUSED(mapping);
+	if (req[1] == 0 || req_length != 2 + req[1]) return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	for (int i = 0; i < req[1]; i++) total += req[2 + i];
+	rsp[0] = 2;
+	rsp[1] = total >> 8;
+	rsp[2] = total & 0xFF;
+	return 3;
+}
+
+static const modbus_function_t functions[] PROGMEM = {
+	{0x41, modbus_frame_rule(1, 1), modbus_frame_rule(1, 1), sum},
+};
+
+static const modbus_function_t builtin[] PROGMEM = {
+	{_FC_READ_HOLDING_REGISTERS, modbus_frame_rule(4, 0), modbus_frame_rule(1, 1), sum},
+};
+
+// Response data one byte longer than a response allows
+static int oversized(modbus_mapping_t *mapping, const uint8_t *req, uint8_t req_length, uint8_t *rsp) {
+	UNUSED(mapping); UNUSED(req); UNUSED(req_length); UNUSED(rsp);
+	return MODBUS_MAX_PDU_LENGTH;
+}
+
+static const modbus_function_t oversized_functions[] PROGMEM = {
+	{0x41, modbus_frame_rule(1, 1), modbus_frame_rule(1, 1), sum},
+	{0x42, modbus_frame_rule(0, 0), modbus_frame_rule(1, 1), oversized},
+};
+
+// Byte counts beyond the meta bytes, or without meta bytes
+static const modbus_function_t bad_request_rule[] PROGMEM = {
+	{0x41, modbus_frame_rule(1, 2), modbus_frame_rule(1, 1), sum},
+};
+
+static const modbus_function_t bad_response_rule[] PROGMEM = {
+	{0x41, modbus_frame_rule(1, 1), modbus_frame_rule(0, 1), sum},
+};
+
+// User functions are served, and skipped byte-exact between other slaves
+static bool test_functions(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs[16];
+	bool ok = true;
+
+	ok &= !slave.setFunctions(builtin, SIZE(builtin));
+	ok &= !slave.setFunctions(bad_request_rule, SIZE(bad_request_rule));
+	ok &= !slave.setFunctions(bad_response_rule, SIZE(bad_response_rule));
+	ok &= slave.setFunctions(oversized_functions, SIZE(oversized_functions));
+
+	// A single request served by the handler, then a response too long
+	const uint8_t request[] = {1, 0x41, 3, 1, 2, 3};
+	const uint8_t response[] = {1, 0x41, 2, 0, 6};
+	const uint8_t too_long[] = {1, 0x42};
+	ok &= transact(slave, request, sizeof(request)) == 7 && memcmp(Serial2.tx, response, 5) == 0;
+	transact(slave, too_long, sizeof(too_long));
+	ok &= exception(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+	ok &= slave.setFunctions(functions, SIZE(functions));
+
+	Serial2.clear();
+	for (int round = 0; round < 100; round++) {
+		uint8_t nb = 1 + round % 20;
+
+		// Request to another slave and its answer, the byte counts of both
+		// differing from ours
+		frame[0] = 5;
+		frame[1] = 0x41;
+		frame[2] = nb + 3;
+		for (int i = 0; i < nb + 3; i++) frame[3 + i] = rand();
+		feed(3 + nb + 3);
+		frame[2] = 4;
+		feed(7);
+
+		frame[0] = 1;
+		frame[2] = nb;
+		for (int i = 0; i < nb; i++) frame[3 + i] = i;
+		feed(3 + nb);
+
+		// Empty data, refused by the handler
+		frame[2] = 0;
+		feed(3);
+	}
+
+	for (int round = 0; round < 100; round++) {
+		uint8_t nb = 1 + round % 20;
+		uint16_t total = nb * (nb - 1) / 2;
+
+		Serial2.tx_length = 0;
+		ok &= slave.loop(regs, SIZE(regs)) == -1 - MODBUS_INFORMATIVE_NOT_FOR_US;
+		ok &= slave.loop(regs, SIZE(regs)) == -1 - MODBUS_INFORMATIVE_NOT_FOR_US;
+		ok &= slave.loop(regs, SIZE(regs)) > 0;
+		ok &= Serial2.tx_length == 7 && Serial2.tx[1] == 0x41 && Serial2.tx[2] == 2 &&
+		      Serial2.tx[3] == (total >> 8) && Serial2.tx[4] == (total & 0xFF) && crc16(Serial2.tx, 7) == 0;
+
+		Serial2.tx_length = 0;
+		slave.loop(regs, SIZE(regs));
+		ok &= Serial2.tx_length == 5 && Serial2.tx[1] == 0xC1 && Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+
+	ok &= !Serial2.available() && slave.counters()->bus_errors == 0;
+	return ok;
+}
+
+// CPU time spent skipping the traffic between the master and other slaves
+static bool bench_foreign(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs[16];
+	int frames = 0, foreign = 0;
+
+	Serial2.clear();
+	slave.setup(115200, 0);
+	srand(2);
+	for (int round = 0; round < ROUNDS; round++) {
+		uint8_t nb   = 1 + rand() % 16;
+		uint8_t kind = 1 + rand() % 7;
+
+		request(2 + rand() % (NODES - 1), kind, nb);
+		answer(kind, nb);
+		frames += 2;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	while (Serial2.available()) {
+		if (slave.loop(regs, SIZE(regs)) == -1 - MODBUS_INFORMATIVE_NOT_FOR_US) foreign++;
+	}
+	auto stop = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+
+	printf("Foreign frames:    %d / %d\n", foreign, frames);
+	printf("Time per frame:    %.1f ns\n", ns / foreign);
+	return foreign == frames;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	bool ok = test_sync();
+	ok &= test_overrun();
+	ok &= test_bits();
+	ok &= test_write_and_read();
+	ok &= test_fifo();
+	ok &= test_device_identification();
+	ok &= test_counters();
+	ok &= test_diagnostics();
+	ok &= test_functions();
+	ok &= bench_foreign();
+
+	if (ok) {
+		puts("Bus sync Ok!");
+		return 0;
+	} else {
+		puts("Bus sync Fail!");
+		return 1;
+	}
+}
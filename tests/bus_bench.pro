@@ -0,0 +1,9 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+DEFINES += ARDUINO=100
+INCLUDEPATH += .
+
+SOURCES += bus_bench.cpp
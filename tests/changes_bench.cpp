@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define NB_REGISTERS 200
+#define REQUESTS     100000
+
+static uint16_t regs[NB_REGISTERS];
+static modbus_change_t expected[REQUESTS];
+static int64_t stamps[REQUESTS];   // When each request reached the slave
+static double latencies[REQUESTS];
+static uint32_t received;
+static uint32_t notified;
+static bool done;
+
+static int64_t now(void) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void notify(void) {
+	notified++;
+}
+
+static void feed(uint8_t *frame, uint8_t length) {
+	add_crc16(frame, length);
+	Serial2.feed(frame, length + 2);
+}
+
+// Writes register 0x06 or 0x10 requests, in turn
+static void write_request(SimpleModbusSlave &slave, int n) {
+	uint8_t frame[_MODBUSINO_RTU_MAX_ADU_LENGTH] = {1};
+	uint16_t nb = n % 2 ? 1 + rand() % 10 : 1;
+	uint16_t address = rand() % (NB_REGISTERS - nb);
+
+	frame[2] = address >> 8;
+	frame[3] = address & 0xFF;
+	expected[n].address = address;
+	expected[n].nb = nb;
+
+	Serial2.clear();
+	if (n % 2) {
+		frame[1] = _FC_WRITE_MULTIPLE_REGISTERS;
+		frame[4] = 0;
+		frame[5] = nb;
+		frame[6] = 2 * nb;
+		for (uint16_t i = 0; i < 2 * nb; i++) frame[7 + i] = n;
+		feed(frame, 7 + 2 * nb);
+	} else {
+		frame[1] = _FC_WRITE_SINGLE_REGISTER;
+		frame[4] = n >> 8;
+		frame[5] = n & 0xFF;
+		feed(frame, 6);
+	}
+
+	stamps[n] = now();
+	slave.loop();
+}
+
+// Pops the changes on another core. They must come in the order of the
+// requests, some of them missing only when an overflow is reported.
+static void consumer(ModbusChangeQueue *changes, bool *ok, bool *overflowed) {
+	modbus_change_t change;
+	uint32_t n = 0;
+
+	for (;;) {
+		bool finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+
+		if (changes->overflowed()) *overflowed = true;
+		if (!changes->pop(&change)) {
+			if (finished) break;
+			std::this_thread::yield();
+			continue;
+		}
+
+		int64_t stamp = now();
+		while (n < REQUESTS && (expected[n].address != change.address || expected[n].nb != change.nb)) n++;
+		if (n < REQUESTS) {
+			latencies[received] = stamp - stamps[n++];
+		} else {
+			*ok = false;
+		}
+		__atomic_store_n(&received, received + 1, __ATOMIC_RELEASE);
+	}
+
+	if (changes->overflowed()) *overflowed = true;
+}
+
+// When paced, a request waits for the change of the previous one to be
+// received, the latency is then that of an idle queue
+static bool run(bool paced) {
+	modbus_change_t buffer[64];
+	ModbusChangeQueue changes(buffer, SIZE(buffer), notify);
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	bool ok = true, overflowed = false;
+
+	mapping.nb_registers  = NB_REGISTERS;
+	mapping.tab_registers = regs;
+	mapping.changes       = &changes;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	received = 0;
+	notified = 0;
+	done = false;
+	std::thread thread([&] { consumer(&changes, &ok, &overflowed); });
+
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < REQUESTS; n++) {
+		if (paced) {
+			while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < (uint32_t) n) std::this_thread::yield();
+		}
+		write_request(slave, n);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	thread.join();
+	auto stop = std::chrono::steady_clock::now();
+
+	double us = std::chrono::duration<double, std::micro>(stop - start).count();
+	std::sort(latencies, latencies + received);
+	printf("%s: %6u / %d changes in %8.0f us, latency median %6.0f ns, 99%% %6.0f ns, max %8.0f ns%s\n",
+	       paced ? "Paced" : "Burst", received, REQUESTS, us,
+	       received ? latencies[received / 2] : 0.0,
+	       received ? latencies[received * 99 / 100] : 0.0,
+	       received ? latencies[received - 1] : 0.0,
+	       overflowed ? ", overflowed" : "");
+
+	ok &= notified == REQUESTS;
+	ok &= received == REQUESTS || overflowed;
+	if (paced) ok &= received == REQUESTS && !overflowed;
+	return ok;
+}
+
+// Full queue: the change is lost and reported once
+static bool test_overflow(void) {
+	modbus_change_t buffer[4], change;
+	ModbusChangeQueue changes(buffer, SIZE(buffer));
+	bool ok = true;
+
+	for (uint16_t i = 0; i < SIZE(buffer); i++) ok &= changes.push(i, 1);
+	ok &= !changes.push(9, 1);
+	ok &= changes.overflowed();
+	ok &= !changes.overflowed();
+
+	for (uint16_t i = 0; i < SIZE(buffer); i++) ok &= changes.pop(&change) && change.address == i;
+	ok &= !changes.pop(&change);
+	return ok;
+}
+
+// The runs of dirty registers of a map, sorted by address, and its queued
+// changes, in request order, are exactly the expected ones
+static bool check_writes(modbus_mapping_t *map, const modbus_change_t *runs, const modbus_change_t *changes,
+                         uint8_t nb) {
+	modbus_change_t change;
+	uint16_t address = 0;
+	bool ok = true;
+
+	for (uint8_t i = 0; i < nb; i++) {
+		ok &= modbus_take_bits(map->tab_dirty_registers, map->nb_registers, &address) == runs[i].nb;
+		ok &= address == runs[i].address;
+	}
+	ok &= modbus_take_bits(map->tab_dirty_registers, map->nb_registers, &address) == 0;
+
+	for (uint8_t i = 0; i < nb; i++) {
+		ok &= map->changes->pop(&change) && change.address == changes[i].address && change.nb == changes[i].nb;
+	}
+	return ok && !map->changes->pop(&change);
+}
+
+// Every function writing holding registers marks them dirty and queues one
+// change, a broadcast doing so in the map of every served address
+static bool test_functions(void) {
+	SimpleModbusSlave slave(1);
+	uint16_t regs1[32] = {}, regs2[32] = {};
+	uint8_t dirty1[4] = {}, dirty2[4] = {};
+	modbus_change_t buffer1[8], buffer2[8];
+	ModbusChangeQueue queue1(buffer1, SIZE(buffer1)), queue2(buffer2, SIZE(buffer2));
+	modbus_mapping_t map1 = {}, map2 = {};
+	uint8_t frame[_MODBUSINO_RTU_MAX_ADU_LENGTH];
+	bool ok = true;
+
+	map1.nb_registers        = SIZE(regs1);
+	map1.tab_registers       = regs1;
+	map1.tab_dirty_registers = dirty1;
+	map1.changes             = &queue1;
+	map2.nb_registers        = SIZE(regs2);
+	map2.tab_registers       = regs2;
+	map2.tab_dirty_registers = dirty2;
+	map2.changes             = &queue2;
+	slave.addSlave(1, &map1);
+	slave.addSlave(2, &map2);
+
+	const uint8_t requests[][16] = {
+		{6, 1, _FC_WRITE_SINGLE_REGISTER, 0, 3, 0x12, 0x34},
+		{11, 1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 10, 0, 2, 4, 0, 1, 0, 2},
+		{8, 1, _FC_MASK_WRITE_REGISTER, 0, 20, 0, 0, 0, 5},
+		{15, 1, _FC_WRITE_AND_READ_REGISTERS, 0, 0, 0, 1, 0, 30, 0, 2, 4, 0, 3, 0, 4},
+		{11, MODBUS_BROADCAST_ADDRESS, _FC_WRITE_MULTIPLE_REGISTERS, 0, 5, 0, 2, 4, 0, 5, 0, 6},
+		// Beyond the registers, nothing is written
+		{11, 1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 31, 0, 2, 4, 0, 7, 0, 7},
+	};
+	for (size_t i = 0; i < SIZE(requests); i++) {
+		memcpy(frame, requests[i] + 1, requests[i][0]);
+		Serial2.clear();
+		feed(frame, requests[i][0]);
+		slave.loop();
+	}
+
+	const modbus_change_t runs1[] = {{3, 1}, {5, 2}, {10, 2}, {20, 1}, {30, 2}};
+	const modbus_change_t changes1[] = {{3, 1}, {10, 2}, {20, 1}, {30, 2}, {5, 2}};
+	const modbus_change_t writes2[] = {{5, 2}};
+
+	ok &= regs1[3] == 0x1234 && regs1[11] == 2 && regs1[20] == 5 && regs1[31] == 4 && regs1[6] == 6 && regs2[5] == 5;
+	ok &= check_writes(&map1, runs1, changes1, SIZE(runs1));
+	ok &= check_writes(&map2, writes2, writes2, SIZE(writes2));
+	return ok;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	bool ok = test_overflow();
+	ok &= test_functions();
+	ok &= run(true);
+	ok &= run(false);
+
+	if (ok) {
+		puts("Changes Ok!");
+		return 0;
+	} else {
+		puts("Changes Fail!");
+		return 1;
+	}
+}
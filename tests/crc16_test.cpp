@@ -17,11 +17,18 @@ bool test(uint8_t *data, uint8_t length) {
 	return crc == 0;
 }
 
+bool test_update(uint8_t *data, uint8_t length) {
+	uint16_t crc = CRC16_INITIAL_VALUE;
+	for (uint8_t i = 0; i < length; i++) crc = crc16_update(crc, data[i]);
+	printf("CRC = 0x%04X (incremental)\n", crc);
+	return crc == crc16(data, length);
+}
+
 int main(int argc, char const *argv[]) {
 	UNUSED(argc);
 	UNUSED(argv);
 
-	if (test(msg, SIZE(msg))) {
+	if (test(msg, SIZE(msg)) && test_update(msg, SIZE(msg))) {
 		puts("CRC16 Ok!");
 	} else {
 		puts("CRC16 Fail!");
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define FILE_SIZE    (1 << 20)
+#define RECORD_BYTES (2 * MODBUS_MAX_FILE_RECORDS)
+#define READ_NB      124  // Largest read fitting a response
+#define WRITE_NB     122  // Largest write fitting a request
+
+static uint8_t content[FILE_SIZE];
+
+typedef bool (*transfer_t)(SimpleModbusSlave &slave, uint16_t file, uint16_t record, uint16_t nb, uint8_t *data);
+
+static bool read_records(SimpleModbusSlave &slave, uint16_t file, uint16_t record, uint16_t nb, uint8_t *data) {
+	uint8_t frame[16] = {1, _FC_READ_FILE_RECORD, 7, 6,
+	                     (uint8_t) (file >> 8), (uint8_t) file,
+	                     (uint8_t) (record >> 8), (uint8_t) record,
+	                     (uint8_t) (nb >> 8), (uint8_t) nb};
+
+	add_crc16(frame, 10);
+	Serial2.clear();
+	Serial2.feed(frame, 12);
+	if (slave.loop() <= 0 || Serial2.tx_length != 7u + nb * 2 || crc16(Serial2.tx, Serial2.tx_length) != 0) return false;
+
+	memcpy(data, Serial2.tx + 5, nb * 2);
+	return true;
+}
+
+static bool write_records(SimpleModbusSlave &slave, uint16_t file, uint16_t record, uint16_t nb, uint8_t *data) {
+	uint8_t frame[_MODBUSINO_RTU_MAX_ADU_LENGTH] = {1, _FC_WRITE_FILE_RECORD, (uint8_t) (7 + nb * 2), 6,
+	                                                (uint8_t) (file >> 8), (uint8_t) file,
+	                                                (uint8_t) (record >> 8), (uint8_t) record,
+	                                                (uint8_t) (nb >> 8), (uint8_t) nb};
+
+	memcpy(frame + 10, data, nb * 2);
+	add_crc16(frame, 10 + nb * 2);
+	Serial2.clear();
+	Serial2.feed(frame, 12 + nb * 2);
+	return slave.loop() > 0 && Serial2.tx_length == 12u + nb * 2 && memcmp(Serial2.tx, frame, 12 + nb * 2) == 0;
+}
+
+// Transfers the whole file, chunk records at a time, returns the throughput
+static double transfer(SimpleModbusSlave &slave, transfer_t function, uint16_t chunk, uint8_t *data, bool *ok) {
+	auto start = std::chrono::steady_clock::now();
+
+	for (uint32_t offset = 0; offset < FILE_SIZE && *ok; ) {
+		uint16_t file   = 1 + offset / RECORD_BYTES;
+		uint16_t record = (offset % RECORD_BYTES) / 2;
+		uint16_t nb     = chunk;
+
+		if (record + nb > MODBUS_MAX_FILE_RECORDS) nb = MODBUS_MAX_FILE_RECORDS - record;
+		if (offset + nb * 2 > FILE_SIZE) nb = (FILE_SIZE - offset) / 2;
+
+		*ok &= function(slave, file, record, nb, data + offset);
+		offset += nb * 2;
+	}
+
+	auto stop = std::chrono::steady_clock::now();
+	return FILE_SIZE / std::chrono::duration<double>(stop - start).count() / (1 << 20);
+}
+
+// Store accepting any records, to see which requests reach it
+class ProbeStore : public ModbusFileStore {
+public:
+	const uint8_t *read(uint16_t file, uint16_t record, uint16_t nb) {
+		UNUSED(file); UNUSED(record); UNUSED(nb);
+		calls++;
+		return records;
+	}
+
+	bool write(uint16_t file, uint16_t record, uint16_t nb, const uint8_t *data) {
+		UNUSED(file); UNUSED(record); UNUSED(nb); UNUSED(data);
+		calls++;
+		return true;
+	}
+
+	uint8_t records[2 * MODBUS_MAX_READ_REGISTERS];
+	int calls = 0;
+};
+
+// Lengths that would wrap or overflow the frame are refused before the
+// store is called
+static bool test_bounds(void) {
+	SimpleModbusSlave slave(1);
+	ProbeStore store;
+	modbus_mapping_t mapping = {};
+	const uint16_t lengths[][2] = {{0, 1}, {0, 0}, {0, 0x8000}, {0, 123}, {9990, 11}};
+	bool ok = true;
+
+	mapping.files = &store;
+	slave.addSlave(1, &mapping);
+
+	for (size_t i = 0; i < SIZE(lengths); i++) {
+		uint16_t record = lengths[i][0], nb = lengths[i][1];
+		uint8_t frame[16] = {1, _FC_WRITE_FILE_RECORD, 9, 6, 0, 1,
+		                     (uint8_t) (record >> 8), (uint8_t) record, (uint8_t) (nb >> 8), (uint8_t) nb};
+		bool valid = i == 0;
+
+		// A single record of data, whatever the length says
+		add_crc16(frame, 12);
+		Serial2.clear();
+		Serial2.feed(frame, 14);
+		slave.loop();
+		ok &= (store.calls > 0) == valid && (Serial2.tx[1] & 0x80) == (valid ? 0 : 0x80);
+		store.calls = 0;
+
+		frame[1] = _FC_READ_FILE_RECORD;
+		frame[2] = 7;
+		add_crc16(frame, 10);
+		Serial2.clear();
+		Serial2.feed(frame, 12);
+		slave.loop();
+		// 123 records still fit a read response
+		valid |= nb == 123;
+		ok &= (store.calls > 0) == valid && (Serial2.tx[1] & 0x80) == (valid ? 0 : 0x80);
+		store.calls = 0;
+	}
+
+	return ok;
+}
+
+// A write file record request is applied completely or not at all
+static bool test_all_or_nothing(void) {
+	SimpleModbusSlave slave(1);
+	uint8_t records[2 * 2 * 4] = {};            // 2 files of 4 records
+	const uint8_t *constant = records;
+	ModbusMemoryFileStore store(records, sizeof(records), 4);
+	ModbusMemoryFileStore read_only(constant, sizeof(records), 4);
+	modbus_mapping_t mapping = {};
+	// Records 0 and 1 of file 1, then of file 3 which does not exist
+	uint8_t frame[32] = {1, _FC_WRITE_FILE_RECORD, 22,
+	                     6, 0, 1, 0, 0, 0, 2, 0x12, 0x34, 0x56, 0x78,
+	                     6, 0, 3, 0, 0, 0, 2, 0x9A, 0xBC, 0xDE, 0xF0};
+	const uint8_t zero[sizeof(records)] = {};
+	bool ok = true;
+
+	mapping.files = &store;
+	slave.addSlave(1, &mapping);
+
+	add_crc16(frame, 25);
+	Serial2.clear();
+	Serial2.feed(frame, 27);
+	slave.loop();
+	ok &= Serial2.tx_length == 5 && Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+	ok &= memcmp(records, zero, sizeof(records)) == 0;
+
+	// File 2 exists, both sub-requests are applied
+	frame[16] = 2;
+	add_crc16(frame, 25);
+	Serial2.clear();
+	Serial2.feed(frame, 27);
+	slave.loop();
+	ok &= Serial2.tx_length == 27 && memcmp(Serial2.tx, frame, 27) == 0;
+	ok &= records[0] == 0x12 && records[3] == 0x78 && records[8] == 0x9A && records[11] == 0xF0;
+
+	// Read-only files are refused before the write
+	mapping.files = &read_only;
+	Serial2.clear();
+	Serial2.feed(frame, 27);
+	slave.loop();
+	ok &= Serial2.tx_length == 5 && Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+	return ok;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	char path[] = "/tmp/modbus_file_XXXXXX";
+	static uint8_t data[FILE_SIZE];
+	SimpleModbusSlave slave(1);
+	ModbusMappedFileStore files;
+	modbus_mapping_t mapping = {};
+	bool ok = true;
+	double speed;
+	int fd;
+
+	ok &= test_bounds();
+	ok &= test_all_or_nothing();
+	for (size_t i = 0; i < sizeof(content); i++) content[i] = rand();
+
+	fd = mkstemp(path);
+	ok &= fd >= 0 && write(fd, content, sizeof(content)) == sizeof(content);
+	close(fd);
+	ok &= files.open(path);
+
+	mapping.files = &files;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 0);
+
+	speed = transfer(slave, read_records, READ_NB, data, &ok);
+	ok &= memcmp(data, content, sizeof(content)) == 0;
+	printf("Read 1 MB:  %.1f MB/s\n", speed);
+
+	for (size_t i = 0; i < sizeof(content); i++) content[i] = rand();
+	speed = transfer(slave, write_records, WRITE_NB, content, &ok);
+	files.close();
+	printf("Write 1 MB: %.1f MB/s\n", speed);
+
+	fd = open(path, O_RDONLY);
+	ok &= read(fd, data, sizeof(data)) == sizeof(data) && memcmp(data, content, sizeof(content)) == 0;
+	close(fd);
+	unlink(path);
+
+	if (ok) {
+		puts("File records Ok!");
+		return 0;
+	} else {
+		puts("File records Fail!");
+		return 1;
+	}
+}
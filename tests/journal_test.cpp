@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define NB_REGISTERS 200
+#define SECTOR_SIZE  4096
+#define NB_SECTORS   8
+#define REQUESTS     100000
+
+// Counts the erases of every sector to check the wear levelling
+class CountingStorage : public ModbusFileJournalStorage {
+public:
+    CountingStorage() : ModbusFileJournalStorage(NB_SECTORS * SECTOR_SIZE, SECTOR_SIZE) {
+        memset(erases, 0, sizeof(erases));
+    }
+
+    bool erase(uint32_t offset) {
+        erases[offset / SECTOR_SIZE]++;
+        return ModbusFileJournalStorage::erase(offset);
+    }
+
+    uint32_t erases[NB_SECTORS];
+};
+
+static void feed(uint8_t *frame, uint8_t length) {
+	add_crc16(frame, length);
+	Serial2.feed(frame, length + 2);
+}
+
+// Setpoints written by a master, most requests hitting a few registers
+static uint16_t write_request(SimpleModbusSlave &slave, uint16_t n) {
+	uint8_t frame[_MODBUSINO_RTU_MAX_ADU_LENGTH] = {1, _FC_WRITE_MULTIPLE_REGISTERS};
+	uint16_t nb = 1 + rand() % 10;
+	uint16_t address = (rand() % 5 ? rand() % 10 : rand() % (NB_REGISTERS - nb));
+
+	frame[2] = address >> 8;
+	frame[3] = address & 0xFF;
+	frame[4] = 0;
+	frame[5] = nb;
+	frame[6] = 2 * nb;
+	for (uint16_t i = 0; i < nb; i++) {
+		frame[7 + 2 * i] = n >> 8;
+		frame[8 + 2 * i] = n & 0xFF;
+	}
+
+	Serial2.clear();
+	feed(frame, 7 + 2 * nb);
+	slave.loop();
+	return nb;
+}
+
+// Journal of the registers written through the slave
+static ModbusJournal *journaled;
+
+static void on_write(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	journaled->changed(address - segment->address, nb);
+}
+
+// The registers restored after a reboot match the saved ones
+static bool check_reboot(CountingStorage *storage, const uint16_t *regs) {
+	uint16_t restored[NB_REGISTERS] = {};
+	uint8_t dirty[(NB_REGISTERS + 7) / 8];
+	ModbusJournal journal(storage, restored, NB_REGISTERS, dirty);
+
+	return journal.begin() && memcmp(restored, regs, sizeof(restored)) == 0;
+}
+
+// Writes REQUESTS requests, flushing every flush_period of them. Returns the
+// bytes written to the storage per byte of register written by the master.
+static double run(const char *path, int flush_period, bool *ok) {
+	static uint16_t regs[NB_REGISTERS];
+	static uint8_t dirty[(NB_REGISTERS + 7) / 8];
+	CountingStorage storage;
+	ModbusJournal journal(&storage, regs, NB_REGISTERS, dirty);
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	modbus_segment_t segment = {};
+	uint32_t data = 0;
+
+	unlink(path);
+	memset(regs, 0, sizeof(regs));
+	memset(dirty, 0, sizeof(dirty));
+	*ok &= storage.open(path);
+	*ok &= !journal.begin();
+
+	journaled             = &journal;
+	segment.nb            = NB_REGISTERS;
+	segment.tab_registers = regs;
+	segment.on_write      = on_write;
+	mapping.nb_segments   = 1;
+	mapping.segments      = &segment;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	// The first flush saves the initial values
+	*ok &= journal.flush();
+	storage.written = 0;
+
+	for (int n = 1; n <= REQUESTS; n++) {
+		data += 2 * write_request(slave, n);
+
+		if (n % flush_period == 0) {
+			*ok &= journal.flush();
+			if (n % (REQUESTS / 10) == 0) *ok &= check_reboot(&storage, regs);
+		}
+	}
+
+	uint32_t min = storage.erases[0], max = storage.erases[0];
+	for (int i = 1; i < NB_SECTORS; i++) {
+		if (storage.erases[i] < min) min = storage.erases[i];
+		if (storage.erases[i] > max) max = storage.erases[i];
+	}
+	*ok &= max - min <= 1;
+
+	printf("Flush every %4d requests: %8u bytes written, %5u erases (%u to %u per sector)\n",
+	       flush_period, storage.written, storage.erased, min, max);
+
+	storage.close();
+	unlink(path);
+	return (double) storage.written / data;
+}
+
+// A flush interrupted by a power loss loses only its own changes
+static bool test_power_loss(const char *path) {
+	uint16_t regs[NB_REGISTERS] = {}, saved[NB_REGISTERS];
+	uint8_t dirty[(NB_REGISTERS + 7) / 8] = {};
+	CountingStorage storage;
+	ModbusJournal journal(&storage, regs, NB_REGISTERS, dirty);
+	bool ok = true;
+
+	unlink(path);
+	ok &= storage.open(path);
+	ok &= journal.flush();
+
+	regs[3] = 1234;
+	journal.changed(3, 1);
+	ok &= journal.flush();
+	memcpy(saved, regs, sizeof(regs));
+
+	// Half a record: its CRC is missing
+	uint8_t record[4] = {5, 0, 1, 0};
+	uint32_t end = _SECTOR_HEADER_LENGTH + 3 * _RECORD_LENGTH(60) + _RECORD_LENGTH(20) + _RECORD_LENGTH(1);
+	ok &= storage.write(end, record, sizeof(record));
+	ok &= check_reboot(&storage, saved);
+
+	// Then the journal goes on in a new sector
+	uint16_t restored[NB_REGISTERS] = {};
+	ModbusJournal rebooted(&storage, restored, NB_REGISTERS, dirty);
+	ok &= rebooted.begin();
+	restored[7] = 77;
+	rebooted.changed(7, 1);
+	ok &= rebooted.flush();
+	saved[7] = 77;
+	ok &= check_reboot(&storage, saved);
+
+	storage.close();
+	unlink(path);
+	return ok;
+}
+
+// A header cut by a power loss, while a new sector is committed, leaves
+// the previous sector in use
+static bool test_torn_header(const char *path) {
+	uint16_t regs[NB_REGISTERS] = {}, saved[NB_REGISTERS];
+	uint8_t dirty[(NB_REGISTERS + 7) / 8] = {};
+	CountingStorage storage;
+	ModbusJournal journal(&storage, regs, NB_REGISTERS, dirty);
+	bool ok = true;
+
+	unlink(path);
+	ok &= storage.open(path);
+	ok &= journal.flush();
+	regs[1] = 4321;
+	journal.changed(1, 1);
+	ok &= journal.flush();
+	memcpy(saved, regs, sizeof(regs));
+
+	// The snapshot of sector 1 is written, then only the first byte of its
+	// header, sequence 2
+	uint8_t header[1] = {2};
+	ok &= storage.erase(SECTOR_SIZE);
+	ok &= storage.write(SECTOR_SIZE + _SECTOR_HEADER_LENGTH, regs, 2 * _RECORD_MAX_REGISTERS);
+	ok &= storage.write(SECTOR_SIZE, header, sizeof(header));
+	ok &= check_reboot(&storage, saved);
+
+	storage.close();
+	unlink(path);
+	return ok;
+}
+
+// A sector must hold the snapshot and a full record, begin() and flush()
+// refuse smaller sectors without touching the storage
+static bool test_geometry(const char *path) {
+	uint16_t regs[NB_REGISTERS] = {};
+	uint8_t dirty[(NB_REGISTERS + 7) / 8] = {};
+	// Header, snapshot in 4 records, then a record of 60 registers
+	const uint16_t sector_size = 6 + 2 * NB_REGISTERS + 4 * 6 + 126;
+	bool ok = true;
+
+	for (uint16_t size = sector_size - 1; size <= sector_size; size++) {
+		ModbusFileJournalStorage storage(2 * size, size);
+		ModbusJournal journal(&storage, regs, NB_REGISTERS, dirty);
+		bool fits = size == sector_size;
+
+		unlink(path);
+		ok &= storage.open(path);
+		ok &= !journal.begin();
+		ok &= journal.flush() == fits && (storage.erased != 0) == fits;
+		ok &= journal.begin() == fits;
+		storage.close();
+	}
+
+	unlink(path);
+	return ok;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	char path[] = "/tmp/journal_testXXXXXX";
+	int fd = mkstemp(path);
+	bool ok = fd >= 0;
+	if (fd >= 0) close(fd);
+
+	double immediate = run(path, 1, &ok);
+	double coalesced = run(path, 100, &ok);
+	ok &= test_power_loss(path);
+	ok &= test_torn_header(path);
+	ok &= test_geometry(path);
+
+	printf("Write amplification, flushed at once:    %6.2f\n", immediate);
+	printf("Write amplification, flushed every 100:  %6.2f\n", coalesced);
+	ok &= coalesced < immediate;
+
+	if (ok) {
+		puts("Journal Ok!");
+		return 0;
+	} else {
+		puts("Journal Fail!");
+		return 1;
+	}
+}
@@ -0,0 +1,15 @@
+/*
+ * Sources of the whole library, built into the tests that drive the slave.
+ * A new module of the library is added here only.
+ */
+
+#include "../crc16.cpp"
+#include "../modbus_bits.cpp"
+#include "../modbus_registers.cpp"
+#include "../modbus_fifo.cpp"
+#include "../modbus_file.cpp"
+#include "../modbus_segment.cpp"
+#include "../modbus_seqlock.cpp"
+#include "../modbus_journal.cpp"
+#include "../modbus_changes.cpp"
+#include "../SimpleModbusSlave.cpp"
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <thread>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define REQUESTS  20000
+
+// One register map shared by the slaves of both buses, the lock keeping
+// the values written by one bus whole for the other
+static uint16_t regs[10];
+static ModbusSeqlock lock;
+static modbus_mapping_t mapping;
+
+static HardwareSerial port_a;
+static HardwareSerial port_b;
+
+static void feed(HardwareSerial &port, uint8_t *frame, uint8_t length) {
+	add_crc16(frame, length);
+	port.feed(frame, length + 2);
+}
+
+// Writes all the registers with a value of its own, then reads them back:
+// they all hold the value of a single write, from either bus
+static bool run(SimpleModbusSlave &slave, HardwareSerial &port, uint16_t first) {
+	bool ok = true;
+
+	for (int n = 0; n < REQUESTS; n++) {
+		uint16_t value = first + 2 * n;
+		uint8_t frame[32] = {1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 0, 0, SIZE(regs), 2 * SIZE(regs)};
+		for (size_t i = 0; i < SIZE(regs); i++) {
+			frame[7 + 2 * i]     = value >> 8;
+			frame[7 + 2 * i + 1] = value & 0xFF;
+		}
+
+		port.clear();
+		feed(port, frame, 7 + 2 * SIZE(regs));
+		ok &= slave.loop() > 0;
+		ok &= port.tx_length == 8 && crc16(port.tx, 8) == 0;
+
+		uint8_t read[8] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, SIZE(regs)};
+		port.clear();
+		feed(port, read, 6);
+		ok &= slave.loop() > 0;
+		ok &= port.tx_length == 5 + 2 * SIZE(regs) && crc16(port.tx, port.tx_length) == 0;
+		for (size_t i = 1; i < SIZE(regs); i++) {
+			ok &= port.tx[3 + 2 * i] == port.tx[3] && port.tx[4 + 2 * i] == port.tx[4];
+		}
+	}
+
+	return ok;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	SimpleModbusSlave slave_a(1, port_a);
+	SimpleModbusSlave slave_b(1, port_b);
+	bool ok_a, ok_b, ok;
+
+	mapping.nb_registers  = SIZE(regs);
+	mapping.tab_registers = regs;
+	mapping.lock          = &lock;
+	slave_a.addSlave(1, &mapping);
+	slave_b.addSlave(1, &mapping);
+	slave_a.setup(115200, 0);
+	slave_b.setup(115200, 1);
+
+	// Even values through bus A, odd ones through bus B
+	std::thread thread_a([&] { ok_a = run(slave_a, port_a, 0); });
+	std::thread thread_b([&] { ok_b = run(slave_b, port_b, 1); });
+	thread_a.join();
+	thread_b.join();
+
+	// The last write of either bus is visible from the other
+	uint8_t frame[8] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, 1};
+	port_b.clear();
+	feed(port_b, frame, 6);
+	ok = slave_b.loop() > 0;
+	uint16_t last = (port_b.tx[3] << 8) + port_b.tx[4];
+	ok &= last == 2 * (REQUESTS - 1) || last == 2 * (REQUESTS - 1) + 1;
+
+	printf("Bus A: %s\n", ok_a ? "Ok" : "Fail");
+	printf("Bus B: %s\n", ok_b ? "Ok" : "Fail");
+
+	if (ok_a && ok_b && ok) {
+		puts("Multiple ports Ok!");
+		return 0;
+	} else {
+		puts("Multiple ports Fail!");
+		return 1;
+	}
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <chrono>
+
+#include "../modbus_registers.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define NB_REGISTERS 125
+#define RUNS         1000000
+
+static uint16_t registers[NB_REGISTERS + 1];
+static uint8_t wire[2 * NB_REGISTERS + 2];
+
+// The per register loops the kernels replace
+static void to_wire_per_register(const uint16_t *src, uint16_t nb, uint8_t *dest) {
+	for (uint16_t i = 0; i < nb; i++) {
+		dest[2 * i]     = src[i] >> 8;
+		dest[2 * i + 1] = src[i] & 0xFF;
+	}
+}
+
+static void from_wire_per_register(const uint8_t *src, uint16_t nb, uint16_t *dest) {
+	for (uint16_t i = 0; i < nb; i++) {
+		dest[i] = (src[2 * i] << 8) + src[2 * i + 1];
+	}
+}
+
+// Every length, from aligned and unaligned buffers
+static bool test_kernels(void) {
+	uint16_t src[NB_REGISTERS + 1], a[NB_REGISTERS + 1], b[NB_REGISTERS + 1];
+	uint8_t wire_a[2 * NB_REGISTERS + 2], wire_b[2 * NB_REGISTERS + 2];
+
+	for (size_t i = 0; i < SIZE(src); i++) src[i] = rand();
+
+	for (uint16_t nb = 0; nb <= NB_REGISTERS; nb++) {
+		for (uint8_t shift = 0; shift < 2; shift++) {
+			memset(wire_a, 0, sizeof(wire_a));
+			memset(wire_b, 0, sizeof(wire_b));
+			to_wire_per_register(src, nb, wire_a + shift);
+			modbus_registers_to_wire(src, nb, wire_b + shift);
+			if (memcmp(wire_a, wire_b, sizeof(wire_a))) return false;
+
+			memset(a, 0, sizeof(a));
+			memset(b, 0, sizeof(b));
+			from_wire_per_register(wire_a + shift, nb, a);
+			modbus_registers_from_wire(wire_a + shift, nb, b);
+			if (memcmp(a, b, sizeof(a)) || memcmp(a, src, 2 * nb)) return false;
+		}
+	}
+
+	return true;
+}
+
+template <typename F>
+static double bench(F to_wire, uint16_t nb) {
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < RUNS; n++) {
+		to_wire(registers, nb, wire);
+		__asm__ __volatile__("" : : "r"(wire) : "memory");
+	}
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / RUNS;
+}
+
+template <typename F>
+static double bench_from(F from_wire, uint16_t nb) {
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < RUNS; n++) {
+		from_wire(wire, nb, registers);
+		__asm__ __volatile__("" : : "r"(registers) : "memory");
+	}
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / RUNS;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+	const uint16_t lengths[] = {1, 2, 4, 8, 16, 32, 64, 125};
+
+	for (size_t i = 0; i < SIZE(registers); i++) registers[i] = rand();
+
+	bool ok = test_kernels();
+
+	printf("Registers   Read loop   kernel    Write loop  kernel (ns)\n");
+	for (size_t i = 0; i < SIZE(lengths); i++) {
+		printf("%9d %9.1f %9.1f %11.1f %9.1f\n", lengths[i],
+		       bench(to_wire_per_register, lengths[i]), bench(modbus_registers_to_wire, lengths[i]),
+		       bench_from(from_wire_per_register, lengths[i]), bench_from(modbus_registers_from_wire, lengths[i]));
+	}
+
+	if (ok) {
+		puts("Registers Ok!");
+		return 0;
+	} else {
+		puts("Registers Fail!");
+		return 1;
+	}
+}
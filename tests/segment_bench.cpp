@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <chrono>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define MAX_SEGMENTS   64
+#define SEGMENT_LENGTH 100
+#define RUNS           1000000
+
+static modbus_segment_t segments[MAX_SEGMENTS];
+static uint16_t registers[MAX_SEGMENTS][SEGMENT_LENGTH];
+
+// Segments of SEGMENT_LENGTH registers from address 40000, every fourth one
+// followed by a gap
+static void build_segments(uint16_t nb_segments) {
+	uint16_t address = 40000;
+
+	for (uint16_t i = 0; i < nb_segments; i++) {
+		segments[i].address       = address;
+		segments[i].nb            = SEGMENT_LENGTH;
+		segments[i].tab_registers = registers[i];
+		address += SEGMENT_LENGTH;
+		if (i % 4 == 3) address += 10;
+	}
+}
+
+// Value expected at a mapped address
+static uint16_t value(uint16_t address) {
+	return address ^ 0x5A5A;
+}
+
+static void feed(uint8_t *frame, uint8_t length) {
+	add_crc16(frame, length);
+	Serial2.feed(frame, length + 2);
+}
+
+static uint16_t get(const uint8_t *p) {
+	return (p[0] << 8) + p[1];
+}
+
+// Reads and writes through the slave, crossing segment boundaries and gaps
+static bool test_slave(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	bool ok = true;
+
+	build_segments(MAX_SEGMENTS);
+	for (uint16_t i = 0; i < MAX_SEGMENTS; i++) {
+		for (uint16_t j = 0; j < SEGMENT_LENGTH; j++) {
+			registers[i][j] = value(segments[i].address + j);
+		}
+	}
+	mapping.nb_segments = MAX_SEGMENTS;
+	mapping.segments    = segments;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	for (int n = 0; n < 10000; n++) {
+		uint16_t nb = 1 + rand() % MODBUS_MAX_READ_REGISTERS;
+		uint16_t address = 39990 + rand() % (MAX_SEGMENTS * (SEGMENT_LENGTH + 3));
+		bool mapped = modbus_find_segments(segments, MAX_SEGMENTS, address, nb, 0) != NULL;
+		uint8_t frame[8] = {1, _FC_READ_HOLDING_REGISTERS,
+		                    (uint8_t) (address >> 8), (uint8_t) address, 0, (uint8_t) nb};
+
+		// A range is mapped when no address of it falls in a gap
+		bool expected = address >= 40000;
+		for (uint32_t a = address; a < (uint32_t) address + nb && expected; a++) {
+			uint32_t offset = a - 40000;
+			expected = offset / (4 * SEGMENT_LENGTH + 10) < MAX_SEGMENTS / 4 &&
+			           offset % (4 * SEGMENT_LENGTH + 10) < 4 * SEGMENT_LENGTH;
+		}
+		ok &= mapped == expected;
+
+		Serial2.clear();
+		feed(frame, 6);
+		slave.loop();
+		if (!mapped) {
+			ok &= Serial2.tx_length == 5 && Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+			continue;
+		}
+
+		ok &= Serial2.tx_length == 5u + 2 * nb && crc16(Serial2.tx, Serial2.tx_length) == 0;
+		for (uint16_t i = 0; i < nb && ok; i++) {
+			ok &= get(Serial2.tx + 3 + 2 * i) == value(address + i);
+		}
+	}
+
+	// A write spanning two segments
+	uint8_t frame[17] = {1, _FC_WRITE_MULTIPLE_REGISTERS, 40098 >> 8, 40098 & 0xFF, 0, 4, 8,
+	                     0, 1, 0, 2, 0, 3, 0, 4};
+	Serial2.clear();
+	feed(frame, 15);
+	slave.loop();
+	ok &= Serial2.tx_length == 8;
+	ok &= registers[0][98] == 1 && registers[0][99] == 2 && registers[1][0] == 3 && registers[1][1] == 4;
+
+	return ok;
+}
+
+static uint16_t computed[10];
+static uint16_t read_address, read_nb, written_address, written_nb;
+
+static void on_read(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	read_address = address;
+	read_nb      = nb;
+	for (uint16_t i = 0; i < nb; i++) {
+		segment->tab_registers[address - segment->address + i] = value(address + i);
+	}
+}
+
+static void on_write(const modbus_segment_t *segment, uint16_t address, uint16_t nb) {
+	UNUSED(segment);
+	written_address = address;
+	written_nb      = nb;
+}
+
+// Input registers computed on demand, only the slice read
+static bool test_callbacks(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	modbus_segment_t segment = {};
+	bool ok = true;
+
+	segment.address       = 30000;
+	segment.nb            = SIZE(computed);
+	segment.tab_registers = computed;
+	segment.on_read       = on_read;
+	segment.on_write      = on_write;
+	mapping.nb_input_segments = 1;
+	mapping.input_segments    = &segment;
+	mapping.nb_segments       = 1;
+	mapping.segments          = &segment;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	uint8_t read[8] = {1, _FC_READ_INPUT_REGISTERS, 30003 >> 8, 30003 & 0xFF, 0, 2};
+	Serial2.clear();
+	feed(read, 6);
+	slave.loop();
+	ok &= read_address == 30003 && read_nb == 2 && computed[2] == 0 && computed[5] == 0;
+	ok &= Serial2.tx_length == 9 && get(Serial2.tx + 3) == value(30003) && get(Serial2.tx + 5) == value(30004);
+
+	uint8_t write[8] = {1, _FC_WRITE_SINGLE_REGISTER, 30009 >> 8, 30009 & 0xFF, 0x12, 0x34};
+	Serial2.clear();
+	feed(write, 6);
+	slave.loop();
+	ok &= written_address == 30009 && written_nb == 1 && computed[9] == 0x1234;
+
+	return ok;
+}
+
+// Typed values in every word order, read then written back through the slave
+static bool test_formats(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	float floats[4] = {1.5f, 1.5f, 1.5f, 1.5f};
+	int64_t int64 = 0x0102030405060708LL;
+	uint32_t uint32 = 0x0A0B0C0D;
+	double real = 1.5;
+	modbus_segment_t typed[] = {
+		{0, 2, (uint16_t *) &floats[0], NULL, NULL, NULL, MODBUS_FORMAT_FLOAT, MODBUS_ORDER_ABCD, MODBUS_ACCESS_READ_WRITE},
+		{2, 2, (uint16_t *) &floats[1], NULL, NULL, NULL, MODBUS_FORMAT_FLOAT, MODBUS_ORDER_CDAB, MODBUS_ACCESS_READ_WRITE},
+		{4, 2, (uint16_t *) &floats[2], NULL, NULL, NULL, MODBUS_FORMAT_FLOAT, MODBUS_ORDER_BADC, MODBUS_ACCESS_READ_WRITE},
+		{6, 2, (uint16_t *) &floats[3], NULL, NULL, NULL, MODBUS_FORMAT_FLOAT, MODBUS_ORDER_DCBA, MODBUS_ACCESS_READ_WRITE},
+		{8, 4, (uint16_t *) &int64, NULL, NULL, NULL, MODBUS_FORMAT_INT64, MODBUS_ORDER_CDAB, MODBUS_ACCESS_READ_WRITE},
+		{12, 2, (uint16_t *) &uint32, NULL, NULL, NULL, MODBUS_FORMAT_UINT32, MODBUS_ORDER_ABCD, MODBUS_ACCESS_READ_WRITE},
+		{14, 4, (uint16_t *) &real, NULL, NULL, NULL, MODBUS_FORMAT_DOUBLE, MODBUS_ORDER_DCBA, MODBUS_ACCESS_READ_WRITE},
+	};
+	const uint16_t expected[] = {0x3FC0, 0x0000, 0x0000, 0x3FC0, 0xC03F, 0x0000, 0x0000, 0xC03F,
+	                             0x0708, 0x0506, 0x0304, 0x0102, 0x0A0B, 0x0C0D, 0x0000, 0x0000, 0x0000, 0xF83F};
+	bool ok = true;
+
+	mapping.nb_segments = SIZE(typed);
+	mapping.segments    = typed;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	uint8_t read[8] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, SIZE(expected)};
+	Serial2.clear();
+	feed(read, 6);
+	slave.loop();
+	ok &= Serial2.tx_length == 5 + 2 * SIZE(expected);
+	for (size_t i = 0; i < SIZE(expected); i++) ok &= get(Serial2.tx + 3 + 2 * i) == expected[i];
+
+	// The response written back gives the values back, whatever the order
+	uint8_t write[64] = {1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 0, 0, SIZE(expected), 2 * SIZE(expected)};
+	memcpy(write + 7, Serial2.tx + 3, 2 * SIZE(expected));
+	memset(floats, 0, sizeof(floats));
+	int64 = 0;
+	uint32 = 0;
+	real = 0;
+	Serial2.clear();
+	feed(write, 7 + 2 * SIZE(expected));
+	slave.loop();
+	ok &= Serial2.tx_length == 8;
+	for (size_t i = 0; i < SIZE(floats); i++) ok &= floats[i] == 1.5f;
+	ok &= int64 == 0x0102030405060708LL && uint32 == 0x0A0B0C0D && real == 1.5;
+
+	return ok;
+}
+
+// Registers stored as sent
+static bool test_wire(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	uint16_t stored[4];
+	modbus_segment_t segment = {};
+	bool ok = true;
+
+	for (uint16_t i = 0; i < SIZE(stored); i++) modbus_wire_set(stored, i, 0x1234 + i);
+	segment.nb            = SIZE(stored);
+	segment.tab_registers = stored;
+	segment.order         = MODBUS_ORDER_WIRE;
+	mapping.nb_segments = 1;
+	mapping.segments    = &segment;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	uint8_t read[8] = {1, _FC_READ_HOLDING_REGISTERS, 0, 1, 0, 3};
+	Serial2.clear();
+	feed(read, 6);
+	slave.loop();
+	ok &= Serial2.tx_length == 11 && get(Serial2.tx + 3) == 0x1235 && get(Serial2.tx + 7) == 0x1237;
+
+	uint8_t write[16] = {1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 2, 0, 2, 4, 0xAB, 0xCD, 0xEF, 0x01};
+	Serial2.clear();
+	feed(write, 11);
+	slave.loop();
+	ok &= modbus_wire_get(stored, 2) == 0xABCD && modbus_wire_get(stored, 3) == 0xEF01;
+
+	uint8_t mask[8] = {1, _FC_MASK_WRITE_REGISTER, 0, 0, 0xFF, 0x00, 0x00, 0x0F};
+	Serial2.clear();
+	feed(mask, 8);
+	slave.loop();
+	ok &= modbus_wire_get(stored, 0) == 0x120F;
+
+	return ok;
+}
+
+static bool request(SimpleModbusSlave &slave, uint8_t *frame, uint8_t length) {
+	Serial2.clear();
+	feed(frame, length);
+	slave.loop();
+	return (Serial2.tx[1] & 0x80) == 0;
+}
+
+// Ranges of one array with different access rights
+static bool test_access(void) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	uint16_t regs[30] = {};
+	const modbus_segment_t segments[] = {
+		{0, 10, regs, NULL, NULL, NULL, 0, 0, MODBUS_ACCESS_READ_ONLY},
+		{10, 10, regs + 10, NULL, NULL, NULL, 0, 0, MODBUS_ACCESS_READ_WRITE},
+		{20, 10, regs + 20, NULL, NULL, NULL, 0, 0, MODBUS_ACCESS_WRITE_ONLY},
+	};
+	bool ok = true;
+
+	mapping.nb_segments = SIZE(segments);
+	mapping.segments    = segments;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	uint8_t read[][8] = {
+		{1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, 20},
+		{1, _FC_READ_HOLDING_REGISTERS, 0, 15, 0, 6},
+	};
+	ok &= request(slave, read[0], 6);
+	ok &= !request(slave, read[1], 6) && Serial2.tx[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+	uint8_t write[][16] = {
+		{1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 10, 0, 2, 4, 0, 1, 0, 2},
+		{1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 19, 0, 2, 4, 0, 1, 0, 2},
+		{1, _FC_WRITE_MULTIPLE_REGISTERS, 0, 9, 0, 2, 4, 0, 1, 0, 2},
+	};
+	ok &= request(slave, write[0], 11);
+	ok &= request(slave, write[1], 11) && regs[20] == 2;
+	ok &= !request(slave, write[2], 11) && regs[9] == 0;
+
+	uint8_t single[8] = {1, _FC_WRITE_SINGLE_REGISTER, 0, 5, 0, 7};
+	ok &= !request(slave, single, 6) && regs[5] == 0;
+
+	uint8_t mask[8] = {1, _FC_MASK_WRITE_REGISTER, 0, 25, 0, 0, 0, 1};
+	ok &= !request(slave, mask, 8);
+
+	return ok;
+}
+
+// Lookup of a single register, the hot path of every request
+static double bench(uint16_t nb_segments) {
+	uint16_t addresses[256];
+	uint32_t found = 0;
+
+	build_segments(nb_segments);
+	for (size_t i = 0; i < SIZE(addresses); i++) {
+		const modbus_segment_t *s = &segments[rand() % nb_segments];
+		addresses[i] = s->address + rand() % s->nb;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < RUNS; n++) {
+		const modbus_segment_t *s = modbus_find_segments(segments, nb_segments, addresses[n % SIZE(addresses)], 1, 0);
+		__asm__ __volatile__("" : : "r"(s) : "memory");
+		found += s != NULL;
+	}
+	auto stop = std::chrono::steady_clock::now();
+
+	if (found != RUNS) return -1;
+	return std::chrono::duration<double, std::nano>(stop - start).count() / RUNS;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	bool ok = test_slave();
+	ok &= test_callbacks();
+	ok &= test_formats();
+	ok &= test_wire();
+	ok &= test_access();
+
+	for (uint16_t nb = 1; nb <= MAX_SEGMENTS; nb <<= 1) {
+		double time = bench(nb);
+		ok &= time > 0;
+		printf("Lookup in %2d segments: %6.1f ns\n", nb, time);
+	}
+
+	if (ok) {
+		puts("Segments Ok!");
+		return 0;
+	} else {
+		puts("Segments Fail!");
+		return 1;
+	}
+}
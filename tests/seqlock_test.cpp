@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <thread>
+
+#include "library.cpp"
+
+#define UNUSED(x) (void)x
+#define SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define READS     200000
+
+// Four 32-bit values, always updated together to the same value
+static uint16_t regs[8];
+static bool done;
+
+static void writer(ModbusSeqlock *lock) {
+	for (uint32_t value = 1; !__atomic_load_n(&done, __ATOMIC_RELAXED); value++) {
+		if (lock) lock->writeBegin();
+		for (size_t i = 0; i < SIZE(regs); i += 2) {
+			__atomic_store_n(&regs[i], (uint16_t) (value >> 16), __ATOMIC_RELAXED);
+			__atomic_store_n(&regs[i + 1], (uint16_t) value, __ATOMIC_RELAXED);
+		}
+		if (lock) lock->writeEnd();
+	}
+}
+
+static void feed(uint8_t *frame, uint8_t length) {
+	add_crc16(frame, length);
+	Serial2.feed(frame, length + 2);
+}
+
+// Reads the values through the slave while the writer runs, returns the
+// number of responses mixing several updates
+static int run(ModbusSeqlock *lock) {
+	SimpleModbusSlave slave(1);
+	modbus_mapping_t mapping = {};
+	int torn = 0;
+
+	mapping.nb_registers  = SIZE(regs);
+	mapping.tab_registers = regs;
+	mapping.lock          = lock;
+	slave.addSlave(1, &mapping);
+	slave.setup(115200, 2);
+
+	done = false;
+	std::thread thread([&] { writer(lock); });
+
+	for (int n = 0; n < READS; n++) {
+		uint8_t frame[8] = {1, _FC_READ_HOLDING_REGISTERS, 0, 0, 0, SIZE(regs)};
+
+		Serial2.clear();
+		feed(frame, 6);
+		slave.loop();
+		if (Serial2.tx_length != 5 + 2 * SIZE(regs)) return -1;
+
+		for (size_t i = 4; i < 2 * SIZE(regs); i++) {
+			if (Serial2.tx[3 + i] != Serial2.tx[3 + i % 4]) {
+				torn++;
+				break;
+			}
+		}
+	}
+
+	__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+	thread.join();
+	return torn;
+}
+
+int main(int argc, char const *argv[]) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	ModbusSeqlock lock;
+	int unlocked = run(NULL);
+	int locked = run(&lock);
+
+	printf("Torn reads without lock: %d / %d\n", unlocked, READS);
+	printf("Torn reads with lock:    %d / %d\n", locked, READS);
+
+	if (unlocked >= 0 && locked == 0) {
+		puts("Seqlock Ok!");
+		return 0;
+	} else {
+		puts("Seqlock Fail!");
+		return 1;
+	}
+}